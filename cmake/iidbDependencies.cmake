@@ -0,0 +1,26 @@
+# lmdb, zstd and lz4 rarely ship cmake configs, so look for them directly
+
+find_package(Threads REQUIRED)
+
+foreach(_iidb_dep lmdb zstd lz4)
+    if(TARGET iidb::${_iidb_dep})
+        continue()
+    endif()
+
+    if(_iidb_dep STREQUAL "lz4")
+        set(_iidb_header lz4hc.h)
+    else()
+        set(_iidb_header ${_iidb_dep}.h)
+    endif()
+
+    find_path(IIDB_${_iidb_dep}_INCLUDE_DIR ${_iidb_header})
+    find_library(IIDB_${_iidb_dep}_LIBRARY ${_iidb_dep})
+    if(NOT IIDB_${_iidb_dep}_INCLUDE_DIR OR NOT IIDB_${_iidb_dep}_LIBRARY)
+        message(FATAL_ERROR "iidb: could not find ${_iidb_dep}, add its prefix to CMAKE_PREFIX_PATH")
+    endif()
+
+    add_library(iidb::${_iidb_dep} UNKNOWN IMPORTED)
+    set_target_properties(iidb::${_iidb_dep} PROPERTIES
+        IMPORTED_LOCATION ${IIDB_${_iidb_dep}_LIBRARY}
+        INTERFACE_INCLUDE_DIRECTORIES ${IIDB_${_iidb_dep}_INCLUDE_DIR})
+endforeach()
@@ -0,0 +1,692 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define IIDB_X86_SIMD 1
+#define IIDB_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#else
+#define IIDB_X86_SIMD 0
+#endif
+
+// Reversible image filters applied to the raw pixels before entropy coding. The filter is stored in the high byte of
+// the header mode, the low byte keeps selecting the codec.
+//
+// A transform (planar, ycocg) rearranges the pixels into one plane per channel, a predictor (sub, paeth) then replaces
+// every byte by its difference to a prediction from already seen neighbours. On planar data the predictor runs on
+// each plane separately with one byte per pixel.
+namespace iidb::filters
+{
+constexpr std::uint16_t none = 0;
+constexpr std::uint16_t sub = 0x0100;
+constexpr std::uint16_t paeth = 0x0200;
+constexpr std::uint16_t planar = 0x0400;
+constexpr std::uint16_t ycocg = 0x0800;  // YCoCg-R on the first three channels, implies planar
+constexpr std::uint16_t mask = 0xff00;
+
+enum class simd_level
+{
+    scalar,
+    sse41,
+    avx2,
+};
+
+inline simd_level detected_simd_level()
+{
+#if IIDB_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return simd_level::avx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return simd_level::sse41;
+#endif
+    return simd_level::scalar;
+}
+
+inline simd_level& active_simd_level()
+{
+    static simd_level level = detected_simd_level();
+    return level;
+}
+
+// mostly useful for testing the scalar kernels on a machine that has the vector ones
+inline void set_simd_level(simd_level level)
+{
+    if (level > detected_simd_level())
+        throw std::invalid_argument { "filters: simd level not supported by this cpu" };
+    active_simd_level() = level;
+}
+
+inline void validate(std::uint16_t mode)
+{
+    auto filter = mode & mask;
+    if (filter & ~(sub | paeth | planar | ycocg))
+        throw std::invalid_argument { "filters: unknown filter" };
+    if ((filter & sub) && (filter & paeth))
+        throw std::invalid_argument { "filters: sub and paeth cannot be combined" };
+}
+
+inline std::uint8_t srai1(std::uint8_t x)
+{
+    return static_cast<std::uint8_t>(static_cast<std::int8_t>(x) >> 1);
+}
+
+inline std::uint8_t paeth_predictor(int a, int b, int c)
+{
+    int pa = std::abs(b - c);
+    int pb = std::abs(a - c);
+    int pc = std::abs(a + b - 2 * c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    else if (pb <= pc)
+        return b;
+    return c;
+}
+
+//
+// scalar kernels
+//
+
+inline void sub_encode_row_scalar(const std::uint8_t* src, std::uint8_t* dst, std::size_t n, std::size_t bpp)
+{
+    for (std::size_t i = 0; i < n; i++)
+        dst[i] = i < bpp ? src[i] : src[i] - src[i - bpp];
+}
+
+inline void sub_decode_row_scalar(std::uint8_t* row, std::size_t n, std::size_t bpp)
+{
+    for (std::size_t i = bpp; i < n; i++)
+        row[i] += row[i - bpp];
+}
+
+inline void paeth_encode_row_scalar(
+    const std::uint8_t* src,
+    const std::uint8_t* prev,
+    std::uint8_t* dst,
+    std::size_t start,
+    std::size_t n,
+    std::size_t bpp)
+{
+    for (std::size_t i = start; i < n; i++)
+        dst[i] = src[i] - paeth_predictor(src[i - bpp], prev[i], prev[i - bpp]);
+}
+
+inline void ycocg_forward_scalar(std::uint8_t* r, std::uint8_t* g, std::uint8_t* b, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; i++)
+    {
+        std::uint8_t co = r[i] - b[i];
+        std::uint8_t t = b[i] + srai1(co);
+        std::uint8_t cg = g[i] - t;
+        r[i] = t + srai1(cg);
+        g[i] = co;
+        b[i] = cg;
+    }
+}
+
+inline void ycocg_inverse_scalar(std::uint8_t* y, std::uint8_t* co, std::uint8_t* cg, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; i++)
+    {
+        std::uint8_t t = y[i] - srai1(cg[i]);
+        std::uint8_t g = cg[i] + t;
+        std::uint8_t b = t - srai1(co[i]);
+        y[i] = b + co[i];
+        co[i] = g;
+        cg[i] = b;
+    }
+}
+
+inline void split_planes_scalar(
+    const std::uint8_t* src,
+    std::uint8_t* dst,
+    std::size_t start,
+    std::size_t npixels,
+    std::size_t channels)
+{
+    for (std::size_t i = start; i < npixels; i++)
+        for (std::size_t c = 0; c < channels; c++)
+            dst[c * npixels + i] = src[i * channels + c];
+}
+
+inline void merge_planes_scalar(
+    const std::uint8_t* src,
+    std::uint8_t* dst,
+    std::size_t start,
+    std::size_t npixels,
+    std::size_t channels)
+{
+    for (std::size_t i = start; i < npixels; i++)
+        for (std::size_t c = 0; c < channels; c++)
+            dst[i * channels + c] = src[c * npixels + i];
+}
+
+#if IIDB_X86_SIMD
+
+//
+// sse4.1 kernels
+//
+
+IIDB_TARGET("sse4.1")
+inline __m128i srai1_sse41(__m128i x)
+{
+    auto shifted = _mm_and_si128(_mm_srli_epi16(x, 1), _mm_set1_epi8(0x7f));
+    return _mm_or_si128(shifted, _mm_and_si128(x, _mm_set1_epi8(static_cast<char>(0x80))));
+}
+
+IIDB_TARGET("sse4.1")
+inline void sub_encode_row_sse41(const std::uint8_t* src, std::uint8_t* dst, std::size_t n, std::size_t bpp)
+{
+    std::size_t i = bpp < n ? bpp : n;
+    std::memcpy(dst, src, i);
+    for (; i + 16 <= n; i += 16)
+    {
+        auto cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        auto left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i - bpp));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_sub_epi8(cur, left));
+    }
+    for (; i < n; i++)
+        dst[i] = src[i] - src[i - bpp];
+}
+
+// prefix sum with a stride of bpp inside each 16 byte block, then carry in the last pixel of the previous block
+template <int bpp>
+IIDB_TARGET("sse4.1")
+inline void sub_decode_row_sse41(std::uint8_t* row, std::size_t n)
+{
+    alignas(16) std::uint8_t carry_indices[16];
+    for (int i = 0; i < 16; i++)
+        carry_indices[i] = 16 - bpp + i % bpp;
+    const auto carry_mask = _mm_load_si128(reinterpret_cast<const __m128i*>(carry_indices));
+
+    auto carry = _mm_setzero_si128();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, bpp));
+        if constexpr (2 * bpp < 16)
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * bpp));
+        if constexpr (4 * bpp < 16)
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4 * bpp));
+        if constexpr (8 * bpp < 16)
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8 * bpp));
+        x = _mm_add_epi8(x, _mm_shuffle_epi8(carry, carry_mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), x);
+        carry = x;
+    }
+    for (i = i < bpp ? bpp : i; i < n; i++)
+        row[i] += row[i - bpp];
+}
+
+IIDB_TARGET("sse4.1")
+inline __m128i paeth_predict_epi16_sse41(__m128i a, __m128i b, __m128i c)
+{
+    auto pa = _mm_abs_epi16(_mm_sub_epi16(b, c));
+    auto pb = _mm_abs_epi16(_mm_sub_epi16(a, c));
+    auto pc = _mm_abs_epi16(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+    auto not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    auto b_or_c = _mm_blendv_epi8(b, c, _mm_cmpgt_epi16(pb, pc));
+    return _mm_blendv_epi8(a, b_or_c, not_a);
+}
+
+IIDB_TARGET("sse4.1")
+inline void paeth_encode_row_sse41(
+    const std::uint8_t* src,
+    const std::uint8_t* prev,
+    std::uint8_t* dst,
+    std::size_t n,
+    std::size_t bpp)
+{
+    std::size_t i = bpp;
+    for (; i + 8 <= n; i += 8)
+    {
+        auto x = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        auto a = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i - bpp)));
+        auto b = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(prev + i)));
+        auto c = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(prev + i - bpp)));
+        auto residual = _mm_and_si128(_mm_sub_epi16(x, paeth_predict_epi16_sse41(a, b, c)), _mm_set1_epi16(0xff));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(residual, residual));
+    }
+    paeth_encode_row_scalar(src, prev, dst, i, n, bpp);
+}
+
+IIDB_TARGET("sse4.1")
+inline void ycocg_forward_sse41(std::uint8_t* r, std::uint8_t* g, std::uint8_t* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        auto r_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + i));
+        auto g_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + i));
+        auto b_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        auto co = _mm_sub_epi8(r_, b_);
+        auto t = _mm_add_epi8(b_, srai1_sse41(co));
+        auto cg = _mm_sub_epi8(g_, t);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(r + i), _mm_add_epi8(t, srai1_sse41(cg)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(g + i), co);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b + i), cg);
+    }
+    ycocg_forward_scalar(r + i, g + i, b + i, n - i);
+}
+
+IIDB_TARGET("sse4.1")
+inline void ycocg_inverse_sse41(std::uint8_t* y, std::uint8_t* co, std::uint8_t* cg, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        auto y_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+        auto co_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(co + i));
+        auto cg_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cg + i));
+        auto t = _mm_sub_epi8(y_, srai1_sse41(cg_));
+        auto b = _mm_sub_epi8(t, srai1_sse41(co_));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), _mm_add_epi8(b, co_));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(co + i), _mm_add_epi8(cg_, t));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(cg + i), b);
+    }
+    ycocg_inverse_scalar(y + i, co + i, cg + i, n - i);
+}
+
+// pshufb masks moving bytes between `channels` interleaved registers and `channels` planar registers; index 0x80
+// produces a zero so every output register is the OR of one shuffle per input register
+template <int channels>
+struct plane_shuffles
+{
+    alignas(16) std::uint8_t split[channels][channels][16];
+    alignas(16) std::uint8_t merge[channels][channels][16];
+
+    plane_shuffles()
+    {
+        for (int p = 0; p < channels; p++)
+            for (int k = 0; k < channels; k++)
+                for (int i = 0; i < 16; i++)
+                {
+                    int from_interleaved = channels * i + p;
+                    this->split[p][k][i] = from_interleaved / 16 == k ? from_interleaved % 16 : 0x80;
+                    int to_interleaved = 16 * p + i;
+                    this->merge[p][k][i] = to_interleaved % channels == k ? to_interleaved / channels : 0x80;
+                }
+    }
+};
+
+template <int channels>
+IIDB_TARGET("sse4.1")
+inline void split_planes_sse41(const std::uint8_t* src, std::uint8_t* dst, std::size_t npixels)
+{
+    static const plane_shuffles<channels> shuffles;
+    __m128i masks[channels][channels];
+    for (int p = 0; p < channels; p++)
+        for (int k = 0; k < channels; k++)
+            masks[p][k] = _mm_load_si128(reinterpret_cast<const __m128i*>(shuffles.split[p][k]));
+
+    std::size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        __m128i in[channels];
+        for (int k = 0; k < channels; k++)
+            in[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * channels + 16 * k));
+        for (int p = 0; p < channels; p++)
+        {
+            auto out = _mm_shuffle_epi8(in[0], masks[p][0]);
+            for (int k = 1; k < channels; k++)
+                out = _mm_or_si128(out, _mm_shuffle_epi8(in[k], masks[p][k]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + p * npixels + i), out);
+        }
+    }
+    split_planes_scalar(src, dst, i, npixels, channels);
+}
+
+template <int channels>
+IIDB_TARGET("sse4.1")
+inline void merge_planes_sse41(const std::uint8_t* src, std::uint8_t* dst, std::size_t npixels)
+{
+    static const plane_shuffles<channels> shuffles;
+    __m128i masks[channels][channels];
+    for (int p = 0; p < channels; p++)
+        for (int k = 0; k < channels; k++)
+            masks[p][k] = _mm_load_si128(reinterpret_cast<const __m128i*>(shuffles.merge[p][k]));
+
+    std::size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        __m128i in[channels];
+        for (int k = 0; k < channels; k++)
+            in[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k * npixels + i));
+        for (int p = 0; p < channels; p++)
+        {
+            auto out = _mm_shuffle_epi8(in[0], masks[p][0]);
+            for (int k = 1; k < channels; k++)
+                out = _mm_or_si128(out, _mm_shuffle_epi8(in[k], masks[p][k]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * channels + 16 * p), out);
+        }
+    }
+    merge_planes_scalar(src, dst, i, npixels, channels);
+}
+
+//
+// avx2 kernels, only where the work does not cross 128 bit lanes
+//
+
+IIDB_TARGET("avx2")
+inline __m256i srai1_avx2(__m256i x)
+{
+    auto shifted = _mm256_and_si256(_mm256_srli_epi16(x, 1), _mm256_set1_epi8(0x7f));
+    return _mm256_or_si256(shifted, _mm256_and_si256(x, _mm256_set1_epi8(static_cast<char>(0x80))));
+}
+
+IIDB_TARGET("avx2")
+inline void sub_encode_row_avx2(const std::uint8_t* src, std::uint8_t* dst, std::size_t n, std::size_t bpp)
+{
+    std::size_t i = bpp < n ? bpp : n;
+    std::memcpy(dst, src, i);
+    for (; i + 32 <= n; i += 32)
+    {
+        auto cur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        auto left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i - bpp));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_sub_epi8(cur, left));
+    }
+    for (; i < n; i++)
+        dst[i] = src[i] - src[i - bpp];
+}
+
+IIDB_TARGET("avx2")
+inline __m256i load_epu8_epi16_avx2(const std::uint8_t* p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+IIDB_TARGET("avx2")
+inline void paeth_encode_row_avx2(
+    const std::uint8_t* src,
+    const std::uint8_t* prev,
+    std::uint8_t* dst,
+    std::size_t n,
+    std::size_t bpp)
+{
+    std::size_t i = bpp;
+    for (; i + 16 <= n; i += 16)
+    {
+        auto x = load_epu8_epi16_avx2(src + i);
+        auto a = load_epu8_epi16_avx2(src + i - bpp);
+        auto b = load_epu8_epi16_avx2(prev + i);
+        auto c = load_epu8_epi16_avx2(prev + i - bpp);
+
+        auto pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+        auto pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+        auto pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, c)));
+        auto not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+        auto b_or_c = _mm256_blendv_epi8(b, c, _mm256_cmpgt_epi16(pb, pc));
+        auto prediction = _mm256_blendv_epi8(a, b_or_c, not_a);
+
+        auto residual = _mm256_and_si256(_mm256_sub_epi16(x, prediction), _mm256_set1_epi16(0xff));
+        auto packed = _mm_packus_epi16(_mm256_castsi256_si128(residual), _mm256_extracti128_si256(residual, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+    }
+    paeth_encode_row_scalar(src, prev, dst, i, n, bpp);
+}
+
+IIDB_TARGET("avx2")
+inline void ycocg_forward_avx2(std::uint8_t* r, std::uint8_t* g, std::uint8_t* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        auto r_ = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r + i));
+        auto g_ = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(g + i));
+        auto b_ = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        auto co = _mm256_sub_epi8(r_, b_);
+        auto t = _mm256_add_epi8(b_, srai1_avx2(co));
+        auto cg = _mm256_sub_epi8(g_, t);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), _mm256_add_epi8(t, srai1_avx2(cg)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(g + i), co);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(b + i), cg);
+    }
+    ycocg_forward_scalar(r + i, g + i, b + i, n - i);
+}
+
+IIDB_TARGET("avx2")
+inline void ycocg_inverse_avx2(std::uint8_t* y, std::uint8_t* co, std::uint8_t* cg, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        auto y_ = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i));
+        auto co_ = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(co + i));
+        auto cg_ = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cg + i));
+        auto t = _mm256_sub_epi8(y_, srai1_avx2(cg_));
+        auto b = _mm256_sub_epi8(t, srai1_avx2(co_));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), _mm256_add_epi8(b, co_));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(co + i), _mm256_add_epi8(cg_, t));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(cg + i), b);
+    }
+    ycocg_inverse_scalar(y + i, co + i, cg + i, n - i);
+}
+
+#endif
+
+//
+// dispatch
+//
+
+inline void sub_encode_row(const std::uint8_t* src, std::uint8_t* dst, std::size_t n, std::size_t bpp)
+{
+#if IIDB_X86_SIMD
+    if (active_simd_level() == simd_level::avx2)
+        return sub_encode_row_avx2(src, dst, n, bpp);
+    if (active_simd_level() == simd_level::sse41)
+        return sub_encode_row_sse41(src, dst, n, bpp);
+#endif
+    sub_encode_row_scalar(src, dst, n, bpp);
+}
+
+inline void sub_decode_row(std::uint8_t* row, std::size_t n, std::size_t bpp)
+{
+#if IIDB_X86_SIMD
+    if (active_simd_level() >= simd_level::sse41)
+    {
+        switch (bpp)
+        {
+        case 1:
+            return sub_decode_row_sse41<1>(row, n);
+        case 2:
+            return sub_decode_row_sse41<2>(row, n);
+        case 3:
+            return sub_decode_row_sse41<3>(row, n);
+        case 4:
+            return sub_decode_row_sse41<4>(row, n);
+        }
+    }
+#endif
+    sub_decode_row_scalar(row, n, bpp);
+}
+
+// prev is null on the first row of an image or plane, where paeth degenerates to sub
+inline void
+paeth_encode_row(const std::uint8_t* src, const std::uint8_t* prev, std::uint8_t* dst, std::size_t n, std::size_t bpp)
+{
+    if (!prev)
+        return sub_encode_row(src, dst, n, bpp);
+
+    for (std::size_t i = 0; i < bpp && i < n; i++)
+        dst[i] = src[i] - prev[i];
+#if IIDB_X86_SIMD
+    if (active_simd_level() == simd_level::avx2)
+        return paeth_encode_row_avx2(src, prev, dst, n, bpp);
+    if (active_simd_level() == simd_level::sse41)
+        return paeth_encode_row_sse41(src, prev, dst, n, bpp);
+#endif
+    paeth_encode_row_scalar(src, prev, dst, bpp, n, bpp);
+}
+
+// every byte depends on its reconstructed left neighbour, so this stays scalar
+inline void paeth_decode_row(std::uint8_t* row, const std::uint8_t* prev, std::size_t n, std::size_t bpp)
+{
+    if (!prev)
+        return sub_decode_row(row, n, bpp);
+
+    for (std::size_t i = 0; i < bpp && i < n; i++)
+        row[i] += prev[i];
+    for (std::size_t i = bpp; i < n; i++)
+        row[i] += paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
+}
+
+inline void ycocg_forward(std::uint8_t* r, std::uint8_t* g, std::uint8_t* b, std::size_t n)
+{
+#if IIDB_X86_SIMD
+    if (active_simd_level() == simd_level::avx2)
+        return ycocg_forward_avx2(r, g, b, n);
+    if (active_simd_level() == simd_level::sse41)
+        return ycocg_forward_sse41(r, g, b, n);
+#endif
+    ycocg_forward_scalar(r, g, b, n);
+}
+
+inline void ycocg_inverse(std::uint8_t* y, std::uint8_t* co, std::uint8_t* cg, std::size_t n)
+{
+#if IIDB_X86_SIMD
+    if (active_simd_level() == simd_level::avx2)
+        return ycocg_inverse_avx2(y, co, cg, n);
+    if (active_simd_level() == simd_level::sse41)
+        return ycocg_inverse_sse41(y, co, cg, n);
+#endif
+    ycocg_inverse_scalar(y, co, cg, n);
+}
+
+inline void split_planes(const std::uint8_t* src, std::uint8_t* dst, std::size_t npixels, std::size_t channels)
+{
+#if IIDB_X86_SIMD
+    if (active_simd_level() >= simd_level::sse41)
+    {
+        switch (channels)
+        {
+        case 2:
+            return split_planes_sse41<2>(src, dst, npixels);
+        case 3:
+            return split_planes_sse41<3>(src, dst, npixels);
+        case 4:
+            return split_planes_sse41<4>(src, dst, npixels);
+        }
+    }
+#endif
+    split_planes_scalar(src, dst, 0, npixels, channels);
+}
+
+inline void merge_planes(const std::uint8_t* src, std::uint8_t* dst, std::size_t npixels, std::size_t channels)
+{
+#if IIDB_X86_SIMD
+    if (active_simd_level() >= simd_level::sse41)
+    {
+        switch (channels)
+        {
+        case 2:
+            return merge_planes_sse41<2>(src, dst, npixels);
+        case 3:
+            return merge_planes_sse41<3>(src, dst, npixels);
+        case 4:
+            return merge_planes_sse41<4>(src, dst, npixels);
+        }
+    }
+#endif
+    merge_planes_scalar(src, dst, 0, npixels, channels);
+}
+
+//
+// whole images
+//
+
+// filters `src` (height x width x channels, interleaved) into `dst`, both hold height * width * channels bytes
+inline void encode(
+    std::uint16_t mode,
+    const std::uint8_t* src,
+    std::uint8_t* dst,
+    std::size_t height,
+    std::size_t width,
+    std::size_t channels)
+{
+    const auto nbytes = height * width * channels;
+    const bool transform = mode & (planar | ycocg);
+    const bool predict = mode & (sub | paeth);
+
+    std::vector<std::uint8_t> planes;
+    if (transform)
+    {
+        // without a predictor the planes can go straight into the output
+        auto out = dst;
+        if (predict)
+        {
+            planes.resize(nbytes);
+            out = planes.data();
+        }
+        split_planes(src, out, height * width, channels);
+        if ((mode & ycocg) && channels >= 3)
+            ycocg_forward(out, out + height * width, out + 2 * height * width, height * width);
+        src = out;
+    }
+
+    if (!predict)
+    {
+        if (!transform)
+            std::memcpy(dst, src, nbytes);
+        return;
+    }
+
+    const auto row_bytes = transform ? width : width * channels;
+    const auto bpp = transform ? 1 : channels;
+    const auto rows = transform ? height * channels : height;
+    for (std::size_t r = 0; r < rows; r++)
+    {
+        auto offset = r * row_bytes;
+        if (mode & sub)
+            sub_encode_row(src + offset, dst + offset, row_bytes, bpp);
+        else
+        {
+            auto prev = r % height == 0 ? nullptr : src + offset - row_bytes;
+            paeth_encode_row(src + offset, prev, dst + offset, row_bytes, bpp);
+        }
+    }
+}
+
+// undoes `encode`; `data` is used as scratch and may only alias `dst` when there is no transform
+inline void decode(
+    std::uint16_t mode,
+    std::uint8_t* data,
+    std::uint8_t* dst,
+    std::size_t height,
+    std::size_t width,
+    std::size_t channels)
+{
+    const bool transform = mode & (planar | ycocg);
+
+    const auto row_bytes = transform ? width : width * channels;
+    const auto bpp = transform ? 1 : channels;
+    const auto rows = transform ? height * channels : height;
+    for (std::size_t r = 0; r < rows; r++)
+    {
+        auto offset = r * row_bytes;
+        if (mode & sub)
+            sub_decode_row(data + offset, row_bytes, bpp);
+        else if (mode & paeth)
+        {
+            auto prev = r % height == 0 ? nullptr : data + offset - row_bytes;
+            paeth_decode_row(data + offset, prev, row_bytes, bpp);
+        }
+    }
+
+    if (transform)
+    {
+        if ((mode & ycocg) && channels >= 3)
+            ycocg_inverse(data, data + height * width, data + 2 * height * width, height * width);
+        merge_planes(data, dst, height * width, channels);
+    }
+    else if (data != dst)
+        std::memcpy(dst, data, height * width * channels);
+}
+
+}
@@ -1,17 +1,42 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstring>
 #include <future>
 #include <lmdb.h>
+#include <limits>
 #include <lz4hc.h>
 #include <math.h>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <sys/stat.h>
 #include <thread>
+#include <variant>
 #include <vector>
 #include <zstd.h>
 
+#include "filters.hpp"
+
 namespace iidb
 {
+// the low byte of the header mode selects the codec, the high byte the filters from filters.hpp
+namespace codec
+{
+constexpr std::uint16_t zstd = 0;
+constexpr std::uint16_t lz4 = 1;
+constexpr std::uint16_t mask = 0x00ff;
+}
+
 enum class openflags
 {
     none = 0,
@@ -33,7 +58,81 @@ constexpr openflags operator|(const openflags& a, const openflags& b) noexcept
     return static_cast<openflags>(static_cast<unsigned int>(a) | static_cast<unsigned int>(b));
 }
 
+template <auto deleter_func>
+struct deleter
+{
+    template <typename PointerType>
+    void operator()(PointerType p)
+    {
+        deleter_func(p);
+    }
+};
+
 class lmdb;
+class map_resizer;
+class write_queue;
+
+// Counts the open transactions of an env so the map is only resized while there are none. It holds no lock inside a
+// transaction, so a transaction may end on another thread than it started on. Once a resize is pending new
+// transactions wait for it, so it cannot be starved by steady read traffic.
+class map_gate
+{
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::size_t open = 0;
+    std::size_t resizes_pending = 0;
+
+public:
+    void enter()
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->condition.wait(lock, [this] { return this->resizes_pending == 0; });
+        this->open++;
+    }
+
+    void leave()
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if (--this->open == 0)
+            this->condition.notify_all();
+    }
+
+    // runs f once no transaction is open, returns false when that took longer than timeout
+    template <typename F>
+    bool exclusive(std::chrono::milliseconds timeout, F&& f)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->resizes_pending++;
+        bool drained = this->condition.wait_for(lock, timeout, [this] { return this->open == 0; });
+        try
+        {
+            if (drained)
+                f();
+        }
+        catch (...)
+        {
+            this->resizes_pending--;
+            this->condition.notify_all();
+            throw;
+        }
+        this->resizes_pending--;
+        this->condition.notify_all();
+        return drained;
+    }
+};
+
+// keeps the lmdb return code around for callers that can recover, e.g. from MDB_MAP_FULL
+class mdb_error : public std::runtime_error
+{
+public:
+    mdb_error(const std::string& what, int code)
+        : std::runtime_error(what + ": " + ::mdb_strerror(code))
+        , code(code)
+    { }
+
+    const int code;
+};
 
 template <typename T = std::byte>
 struct blob : MDB_val
@@ -50,7 +149,7 @@ struct blob : MDB_val
 
     std::vector<T> copy() const
     {
-        return std::vector<T>(this->data(), this->data + this->size());
+        return std::vector<T>(this->data(), this->data() + this->size());
     }
 };
 
@@ -58,12 +157,25 @@ class txn
 {
 private:
     MDB_txn* _handle = nullptr;
+    // entered while the transaction is open so the map cannot be resized under it
+    map_gate* _gate = nullptr;
     friend class lmdb;
+    friend class map_resizer;
+
+    void _release_map()
+    {
+        if (this->_gate)
+        {
+            this->_gate->leave();
+            this->_gate = nullptr;
+        }
+    }
 
     txn(MDB_env* const env, bool writeable)
     {
-        if (::mdb_txn_begin(env, nullptr, writeable ? 0 : MDB_RDONLY, &this->_handle) != MDB_SUCCESS)
-            throw std::runtime_error { "mdb: failed to begin transaction" };
+        auto rc = ::mdb_txn_begin(env, nullptr, writeable ? 0 : MDB_RDONLY, &this->_handle);
+        if (rc != MDB_SUCCESS)
+            throw mdb_error { "mdb: failed to begin transaction", rc };
     }
 
 public:
@@ -72,6 +184,7 @@ public:
     txn(txn&& other)
     {
         std::swap(this->_handle, other._handle);
+        std::swap(this->_gate, other._gate);
     }
 
     ~txn()
@@ -83,8 +196,11 @@ public:
     {
         if (this->_handle)
         {
-            ::mdb_txn_commit(this->_handle);
+            auto rc = ::mdb_txn_commit(this->_handle);
             this->_handle = nullptr;
+            this->_release_map();
+            if (rc != MDB_SUCCESS)
+                throw mdb_error { "mdb: failed to commit transaction", rc };
         }
     }
 
@@ -94,16 +210,37 @@ public:
         {
             ::mdb_txn_abort(this->_handle);
             this->_handle = nullptr;
+            this->_release_map();
         }
     }
 
-    template <typename T = std::byte>
-    std::optional<blob<T>> get(std::string_view key)
+    bool active() const
+    {
+        return static_cast<bool>(this->_handle);
+    }
+
+    // opens the unnamed database when name is null, returns nothing when a named database does not exist
+    std::optional<MDB_dbi> open_dbi(const char* name = nullptr, bool create = false)
     {
         MDB_dbi dbi_handle = 0;
-        if (::mdb_dbi_open(this->_handle, nullptr, 0, &dbi_handle) != MDB_SUCCESS)
+        auto rc = ::mdb_dbi_open(this->_handle, name, create ? MDB_CREATE : 0, &dbi_handle);
+        if (rc == MDB_NOTFOUND)
+            return std::nullopt;
+        else if (rc != MDB_SUCCESS)
             throw std::runtime_error { "mdb: failed to open dbi" };
 
+        return dbi_handle;
+    }
+
+    template <typename T = std::byte>
+    std::optional<blob<T>> get(std::string_view key)
+    {
+        return this->get<T>(key, *this->open_dbi());
+    }
+
+    template <typename T = std::byte>
+    std::optional<blob<T>> get(std::string_view key, MDB_dbi dbi_handle)
+    {
         MDB_val key_;
         blob<T> out;
         key_.mv_data = const_cast<char*>(key.data());
@@ -121,17 +258,19 @@ public:
     template <typename T = std::byte>
     void put(std::string_view key, blob<T> value)
     {
-        MDB_dbi dbi_handle = 0;
-        if (::mdb_dbi_open(this->_handle, nullptr, 0, &dbi_handle) != MDB_SUCCESS)
-            throw std::runtime_error { "mdb: failed to open dbi" };
+        this->put(key, value, *this->open_dbi());
+    }
 
+    template <typename T = std::byte>
+    void put(std::string_view key, blob<T> value, MDB_dbi dbi_handle)
+    {
         MDB_val key_;
         key_.mv_data = const_cast<char*>(key.data());
         key_.mv_size = key.size();
 
         auto rc = ::mdb_put(this->_handle, dbi_handle, &key_, &value, 0);
         if (rc != MDB_SUCCESS)
-            throw std::runtime_error { "mdb: failed to get value" };
+            throw mdb_error { "mdb: failed to put value", rc };
     }
 
     template <typename T = std::byte>
@@ -145,6 +284,43 @@ public:
     {
         return this->get(std::to_string(key));
     }
+
+    // visits every entry in key order
+    template <typename F>
+    void for_each(MDB_dbi dbi_handle, F&& f)
+    {
+        this->for_each(dbi_handle, {}, std::numeric_limits<std::size_t>::max(), std::forward<F>(f));
+    }
+
+    // visits up to limit entries in key order, starting after `after` (at the first entry when empty), and returns how
+    // many it visited
+    template <typename F>
+    std::size_t for_each(MDB_dbi dbi_handle, std::string_view after, std::size_t limit, F&& f)
+    {
+        MDB_cursor* cursor_handle = nullptr;
+        if (::mdb_cursor_open(this->_handle, dbi_handle, &cursor_handle) != MDB_SUCCESS)
+            throw std::runtime_error { "mdb: failed to open cursor" };
+        std::unique_ptr<MDB_cursor, deleter<::mdb_cursor_close>> cursor { cursor_handle };
+
+        // keys are never empty, so an empty `after` can't be confused with a key
+        MDB_val key { after.size(), const_cast<char*>(after.data()) };
+        blob<std::byte> value;
+        auto rc = ::mdb_cursor_get(cursor.get(), &key, &value, after.empty() ? MDB_FIRST : MDB_SET_RANGE);
+        if (rc == MDB_SUCCESS && !after.empty()
+            && std::string_view { reinterpret_cast<const char*>(key.mv_data), key.mv_size } == after)
+            rc = ::mdb_cursor_get(cursor.get(), &key, &value, MDB_NEXT);
+
+        std::size_t visited = 0;
+        for (; rc == MDB_SUCCESS && visited < limit; visited++)
+        {
+            f(std::string_view { reinterpret_cast<const char*>(key.mv_data), key.mv_size }, value);
+            if (visited + 1 < limit)
+                rc = ::mdb_cursor_get(cursor.get(), &key, &value, MDB_NEXT);
+        }
+        if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND)
+            throw std::runtime_error { "mdb: failed to iterate cursor" };
+        return visited;
+    }
 };
 
 class lmdb
@@ -153,12 +329,18 @@ protected:
     MDB_env* _handle = nullptr;
 
 public:
-    lmdb(std::string_view path, openflags flags = openflags::nosubdir | openflags::rdonly | openflags::nolock)
+    lmdb(
+        std::string_view path,
+        openflags flags = openflags::nosubdir | openflags::rdonly | openflags::nolock,
+        unsigned int maxdbs = 0)
     {
         auto rc = ::mdb_env_create(&this->_handle);
         if (rc != MDB_SUCCESS)
             throw std::runtime_error { "mdb: failed to create environment" };
 
+        if (maxdbs > 0 && ::mdb_env_set_maxdbs(this->_handle, maxdbs) != MDB_SUCCESS)
+            throw std::runtime_error { "mdb: failed to set max dbs" };
+
         rc = ::mdb_env_open(this->_handle, path.data(), static_cast<unsigned int>(flags), 0644);
         if (rc != MDB_SUCCESS)
             throw std::runtime_error { "mdb: failed to open environment" };
@@ -208,12 +390,161 @@ public:
         return *this;
     }
 
-    txn begin(bool writeable = false)
+    txn begin(bool writeable = false) const
     {
         return txn(this->_handle, writeable);
     }
 };
 
+struct map_options
+{
+    std::size_t initial_size = 1024L * 1024 * 1024;  // 1 Gibibyte, never below what the file already holds
+    double growth_factor = 2.0;
+    std::size_t max_size = 0;  // no limit
+    // how long a full writer waits for open transactions to finish before giving up on growing the map
+    std::chrono::milliseconds resize_timeout { 10000 };
+};
+
+// LMDB can only remap while no transaction of this process is open, which the gate keeps track of. Writers are
+// serialized here as well, so that growing the map and the per-commit durability flags only ever race with readers.
+class map_resizer
+{
+private:
+    MDB_env* env;
+    const map_options options;
+
+    map_gate gate;
+    std::mutex write_mutex;
+
+public:
+    map_resizer(MDB_env* env, map_options options)
+        : env(env)
+        , options(options)
+    {
+        if (options.growth_factor <= 1.0)
+            throw std::invalid_argument { "map growth factor must be greater than 1" };
+        if (::mdb_env_set_mapsize(this->env, options.initial_size) != MDB_SUCCESS)
+            throw std::runtime_error { "mdb: failed to set map_size" };
+    }
+
+    std::size_t mapsize()
+    {
+        MDB_envinfo info;
+        if (::mdb_env_info(this->env, &info) != MDB_SUCCESS)
+            throw std::runtime_error { "mdb: failed to get env info" };
+        return info.me_mapsize;
+    }
+
+    txn begin(bool writeable)
+    {
+        for (;;)
+        {
+            this->gate.enter();
+            try
+            {
+                txn txn_(this->env, writeable);
+                txn_._gate = &this->gate;
+                return txn_;
+            }
+            catch (const mdb_error& e)
+            {
+                this->gate.leave();
+                if (e.code != MDB_MAP_RESIZED)
+                    throw;
+            }
+            catch (...)
+            {
+                this->gate.leave();
+                throw;
+            }
+
+            // another process grew the map, adopt its size
+            this->_resize(0);
+        }
+    }
+
+    // Runs f in a write transaction and commits, growing the map and rerunning f as long as it is full. The durability
+    // flags (nosync, nometasync, mapasync) only apply to this commit.
+    template <typename F>
+    void write(F&& f, openflags durability = openflags::none)
+    {
+        std::unique_lock<std::mutex> writer(this->write_mutex);
+
+        // env flags are only read when committing, and commits are serialized by write_mutex
+        unsigned int current_flags = 0;
+        if (::mdb_env_get_flags(this->env, &current_flags) != MDB_SUCCESS)
+            throw std::runtime_error { "mdb: failed to get env flags" };
+        auto added_flags = static_cast<unsigned int>(durability) & ~current_flags;
+        if (added_flags && ::mdb_env_set_flags(this->env, added_flags, 1) != MDB_SUCCESS)
+            throw std::runtime_error { "mdb: failed to set env flags" };
+
+        try
+        {
+            this->_write(f);
+        }
+        catch (...)
+        {
+            if (added_flags)
+                ::mdb_env_set_flags(this->env, added_flags, 0);
+            throw;
+        }
+        if (added_flags)
+            ::mdb_env_set_flags(this->env, added_flags, 0);
+    }
+
+    void grow(std::size_t seen)
+    {
+        auto current = this->mapsize();
+        if (current > seen)
+            return;  // somebody else already grew it
+        if (this->options.max_size && current >= this->options.max_size)
+            throw mdb_error { "mdb: map size limit reached", MDB_MAP_FULL };
+
+        // round to whole mebibytes so the size stays a multiple of the page size
+        constexpr std::size_t mebibyte = 1024 * 1024;
+        auto size = static_cast<std::size_t>(current * this->options.growth_factor);
+        size = (size + mebibyte - 1) / mebibyte * mebibyte;
+        if (this->options.max_size)
+            size = std::min(size, this->options.max_size);
+
+        this->_resize(size);
+    }
+
+private:
+    template <typename F>
+    void _write(F& f)
+    {
+        for (;;)
+        {
+            auto seen = this->mapsize();
+            try
+            {
+                auto txn = this->begin(true);
+                f(txn);
+                txn.commit();
+                return;
+            }
+            catch (const mdb_error& e)
+            {
+                if (e.code != MDB_MAP_FULL)
+                    throw;
+            }
+
+            this->grow(seen);
+        }
+    }
+
+    void _resize(std::size_t size)
+    {
+        bool resized = this->gate.exclusive(this->options.resize_timeout, [&] {
+            if (::mdb_env_set_mapsize(this->env, size) != MDB_SUCCESS)
+                throw std::runtime_error { "mdb: failed to set map_size" };
+        });
+        if (!resized)
+            throw std::runtime_error { "mdb: open transactions kept the map from being resized" };
+    }
+};
+
 class thread_pool
 {
 private:
@@ -288,13 +619,15 @@ public:
         return res;
     }
 
+    // f gets the index of the worker running it, or num_threads() when it runs on the calling thread. Rethrows the
+    // first exception once every call has finished, so f's captures are never used after returning.
     template <typename F>
     void parallel_for(size_t start, size_t end, F&& f)
     {
         if (end - start < 2)
         {
             for (size_t i = start; i < end; i++)
-                f(i, 0);
+                f(i, this->num_threads());
             return;
         }
 
@@ -305,16 +638,187 @@ public:
         }
         for (auto& future : futures)
             future.wait();
+        for (auto& future : futures)
+            future.get();
     }
 };
 
-template <auto deleter_func>
-struct deleter
+struct write_queue_options
 {
-    template <typename PointerType>
-    void operator()(PointerType p)
+    // how long the committer waits for more writes before committing a partially filled batch
+    std::chrono::microseconds max_delay { 2000 };
+    std::size_t max_batch_items = 1024;
+    std::size_t max_batch_bytes = 64 * 1024 * 1024;
+    // only nosync, nometasync and mapasync are meaningful here, they apply to the queue's commits only
+    openflags durability = openflags::none;
+};
+
+// Group commit: producers enqueue already-compressed values and a single committer thread writes everything
+// pending in one transaction. A future completes once the transaction holding its write has been committed.
+class write_queue
+{
+private:
+    struct pending_write
     {
-        deleter_func(p);
+        std::string key;
+        std::vector<std::byte> value;
+        std::promise<void> done;
+    };
+
+    MDB_env* env;
+    map_resizer& map;
+    const write_queue_options options;
+
+    std::vector<pending_write> pending;
+    std::size_t pending_bytes = 0;
+    std::size_t in_flight = 0;
+    std::size_t flush_waiters = 0;
+
+    // synchronization
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    std::condition_variable drained;
+    bool stop = false;
+    std::mutex close_mutex;
+    std::thread committer;
+
+public:
+    write_queue(MDB_env* env, map_resizer& map, write_queue_options options)
+        : env(env)
+        , map(map)
+        , options(options)
+    {
+        auto durability = static_cast<unsigned int>(options.durability);
+        if (durability & ~static_cast<unsigned int>(openflags::nosync | openflags::nometasync | openflags::mapasync))
+            throw std::invalid_argument { "write_queue: durability only accepts nosync, nometasync and mapasync" };
+
+        this->committer = std::thread([this] { this->run(); });
+    }
+
+    write_queue(const write_queue&) = delete;
+
+    ~write_queue()
+    {
+        // call close() first to hear about a failed sync
+        try
+        {
+            this->close();
+        }
+        catch (const mdb_error&)
+        { }
+    }
+
+    // commits everything pending and stops the committer, later enqueues throw
+    void close()
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->queue_mutex);
+            this->stop = true;
+        }
+        this->condition.notify_all();
+
+        std::unique_lock<std::mutex> lock(this->close_mutex);
+        if (!this->committer.joinable())
+            return;
+        this->committer.join();
+
+        // make the batches committed without syncing durable
+        if (this->options.durability != openflags::none)
+        {
+            auto rc = ::mdb_env_sync(this->env, 1);
+            if (rc != MDB_SUCCESS)
+                throw mdb_error { "mdb: failed to sync environment", rc };
+        }
+    }
+
+    std::future<void> enqueue(std::string key, std::vector<std::byte> value)
+    {
+        pending_write write { std::move(key), std::move(value), {} };
+        auto res = write.done.get_future();
+        {
+            std::unique_lock<std::mutex> lock(this->queue_mutex);
+
+            // don't allow enqueueing after stopping the queue
+            if (this->stop)
+                throw std::runtime_error("enqueue on stopped write_queue");
+
+            this->pending_bytes += write.key.size() + write.value.size();
+            this->pending.push_back(std::move(write));
+        }
+        this->condition.notify_one();
+
+        return res;
+    }
+
+    // blocks until everything enqueued so far has been committed
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(this->queue_mutex);
+        this->flush_waiters++;
+        this->condition.notify_one();
+        this->drained.wait(lock, [this] { return this->pending.empty() && this->in_flight == 0; });
+        this->flush_waiters--;
+    }
+
+private:
+    bool batch_full() const
+    {
+        return this->pending.size() >= this->options.max_batch_items
+            || this->pending_bytes >= this->options.max_batch_bytes;
+    }
+
+    void run()
+    {
+        for (;;)
+        {
+            std::vector<pending_write> batch;
+
+            {
+                std::unique_lock<std::mutex> lock(this->queue_mutex);
+                this->condition.wait(lock, [this] { return this->stop || !this->pending.empty(); });
+                if (this->stop && this->pending.empty())
+                    return;
+
+                // give other producers a chance to join this transaction
+                auto deadline = std::chrono::steady_clock::now() + this->options.max_delay;
+                this->condition.wait_until(
+                    lock, deadline, [this] { return this->stop || this->flush_waiters > 0 || this->batch_full(); });
+
+                batch.swap(this->pending);
+                this->pending_bytes = 0;
+                this->in_flight = batch.size();
+            }
+
+            this->commit_batch(batch);
+
+            {
+                std::unique_lock<std::mutex> lock(this->queue_mutex);
+                this->in_flight = 0;
+            }
+            this->drained.notify_all();
+        }
+    }
+
+    void commit_batch(std::vector<pending_write>& batch)
+    {
+        try
+        {
+            this->map.write(
+                [&](txn& txn) {
+                    for (auto& write : batch)
+                        txn.put(write.key, write.value);
+                },
+                this->options.durability);
+        }
+        catch (...)
+        {
+            for (auto& write : batch)
+                write.done.set_exception(std::current_exception());
+            return;
+        }
+
+        for (auto& write : batch)
+            write.done.set_value();
     }
 };
 
@@ -333,20 +837,384 @@ struct image_dim
     std::uint16_t channels;
 };
 
+// integer keys are stored as their decimal representation
+typedef std::variant<int64_t, std::string_view> key_type;
+
+inline std::string to_key(const key_type& key)
+{
+    return std::visit(
+        [](auto&& arg) {
+            using T = std::decay_t<decltype(arg)>;
+            if constexpr (std::is_same_v<T, int64_t>)
+                return std::to_string(arg);
+            else  // string_view
+                return std::string { arg };
+        },
+        key);
+}
+
+// per-item result of a deadline-bounded getmulti
+enum class read_status : std::uint8_t
+{
+    ok,
+    missing,
+    timed_out,  // not started before the deadline
+    failed,
+};
+
+// what a deadline-bounded getmulti does about keys that are not in the db
+enum class miss_policy
+{
+    raise,  // throw std::out_of_range before decoding anything
+    skip,  // leave the destination untouched
+    zero,  // zero the destination, also done for items that timed out or failed
+};
+
+struct storage_stats
+{
+    std::size_t map_size;
+    std::size_t page_size;
+    std::size_t pages;  // up to the last page ever written
+    std::size_t free_pages;  // on the freelist, reused before the file grows again
+    std::size_t file_size;
+    std::size_t allocated_size;  // actually backed by disk, below file_size when the file is sparse
+
+    // the share of the file a compacting copy (mdb_copy -c) would give back
+    double free_fraction() const
+    {
+        return this->pages ? double(this->free_pages) / this->pages : 0.0;
+    }
+};
+
+// named database holding a float weight per key, read by weighted samplers
+constexpr std::string_view weights_db_name = "__iidb_weights__";
+
+// the weights database is a record in the unnamed one, so its name can't be used as an image key
+inline void check_key(std::string_view key)
+{
+    if (key == weights_db_name)
+        throw std::invalid_argument { "reserved key: " + std::string { key } };
+}
+
+// Draws keys from the ones the database held when the sampler was made. Only the key bytes are kept, plus 4 bytes per
+// key (and 8 more when weighted); values are looked up when sampling, so a sampler keeps no transaction open.
+class sampler
+{
+public:
+    static constexpr std::size_t scan_chunk = 65536;
+
+    // Keys are read scan_chunk at a time, each chunk in a transaction from begin(), so that scanning a large database
+    // doesn't hold off growing the map until it is done. Keys without a stored weight are never drawn by a weighted
+    // sampler.
+    template <typename Begin>
+    sampler(Begin&& begin, std::optional<MDB_dbi> weights_dbi, bool weighted, std::uint64_t seed)
+        : rng(seed)
+    {
+        if (weighted && !weights_dbi)
+            throw std::runtime_error { "no weights stored" };
+
+        std::string last;
+        double total = 0.0;
+        for (auto visited = scan_chunk; visited == scan_chunk;)
+        {
+            auto txn = begin();
+            auto main_dbi = *txn.open_dbi();
+            if (!weighted)
+            {
+                visited = txn.for_each(main_dbi, last, scan_chunk, [&](std::string_view key, blob<std::byte>) {
+                    last = key;
+                    if (key != weights_db_name)
+                        this->_add(key);
+                });
+                continue;
+            }
+
+            visited = txn.for_each(*weights_dbi, last, scan_chunk, [&](std::string_view key, blob<std::byte> weight) {
+                last = key;
+                float w = 0.0f;
+                std::memcpy(&w, weight.data(), sizeof(float));
+                if (!(w > 0.0f) || !txn.get(key, main_dbi))
+                    return;
+
+                this->_add(key);
+                total += w;
+                this->cumulative.push_back(total);
+            });
+        }
+    }
+
+    std::size_t size() const
+    {
+        return this->ends.size();
+    }
+
+    // with replacement, the keys point into the sampler
+    std::vector<std::string_view> sample(std::size_t n)
+    {
+        if (this->ends.empty())
+            throw std::runtime_error { "nothing to sample from" };
+
+        std::vector<std::string_view> out(n);
+        if (this->cumulative.empty())
+        {
+            std::uniform_int_distribution<std::size_t> dist(0, this->ends.size() - 1);
+            for (auto& key : out)
+                key = this->_key(dist(this->rng));
+        }
+        else
+        {
+            std::uniform_real_distribution<double> dist(0.0, this->cumulative.back());
+            for (auto& key : out)
+            {
+                auto it = std::upper_bound(this->cumulative.begin(), this->cumulative.end(), dist(this->rng));
+                key = this->_key(std::min<std::size_t>(it - this->cumulative.begin(), this->ends.size() - 1));
+            }
+        }
+        return out;
+    }
+
+private:
+    void _add(std::string_view key)
+    {
+        if (this->keys.size() + key.size() > std::numeric_limits<std::uint32_t>::max())
+            throw std::length_error { "sampler: keys take up more than 4 GiB" };
+        this->keys.append(key);
+        this->ends.push_back(std::uint32_t(this->keys.size()));
+    }
+
+    std::string_view _key(std::size_t i) const
+    {
+        auto begin = i ? this->ends[i - 1] : 0;
+        return { this->keys.data() + begin, this->ends[i] - begin };
+    }
+
+    std::string keys;  // all keys back to back
+    std::vector<std::uint32_t> ends;
+    std::vector<double> cumulative;
+    std::mt19937_64 rng;
+};
+
 class iidb : public lmdb
 {
 public:
-    iidb(std::string_view path, bool writeable = false)
-        : lmdb(path, openflags::nosubdir | openflags::nolock | (writeable ? openflags::none : openflags::rdonly))
+    iidb(std::string_view path, bool writeable = false, map_options options = {})
+        // Writers need the lock file: without its reader table LMDB reuses pages that open snapshots still read.
+        // notls because a snapshot can end on another thread than the one that began it (see getmulti_async).
+        : lmdb(
+            path,
+            openflags::nosubdir | openflags::notls
+                | (writeable ? openflags::none : openflags::rdonly | openflags::nolock),
+            1)
         , pool(new thread_pool { std::thread::hardware_concurrency() })
+        , map(new map_resizer { this->_handle, options })
     {
-        this->set_mapsize(1024L * 1024 * 1024 * 1024);  // 1 Tebibyte
+        // LMDB doesn't allow opening databases from concurrent transactions, so this is the only place that does
+        if (writeable)
+        {
+            this->write([this](txn& txn) { this->weights_dbi = txn.open_dbi(weights_db_name.data(), true); });
+            return;
+        }
+        auto txn = this->begin();
+        this->weights_dbi = txn.open_dbi(weights_db_name.data());
+        txn.commit();  // aborting would close the handle again
     }
 
     iidb(iidb&&) = default;
 
+    ~iidb()
+    {
+        // call close() first to hear about a failed sync of the write queue
+        try
+        {
+            this->close();
+        }
+        catch (const mdb_error&)
+        { }
+    }
+
+    void close()
+    {
+        this->stop_write_queue();
+        lmdb::close();
+    }
+
+    txn begin(bool writeable = false) const
+    {
+        return this->map->begin(writeable);
+    }
+
+    // prefer this over begin(true): it serializes writers and grows the map when it fills up, rerunning f
+    template <typename F>
+    void write(F&& f)
+    {
+        this->map->write(std::forward<F>(f));
+    }
+
+    storage_stats stats() const
+    {
+        MDB_envinfo info;
+        if (::mdb_env_info(this->_handle, &info) != MDB_SUCCESS)
+            throw std::runtime_error { "mdb: failed to get env info" };
+        MDB_stat env_stat;
+        if (::mdb_env_stat(this->_handle, &env_stat) != MDB_SUCCESS)
+            throw std::runtime_error { "mdb: failed to get env info stat" };
+
+        storage_stats out {};
+        out.map_size = info.me_mapsize;
+        out.page_size = env_stat.ms_psize;
+        out.pages = info.me_last_pgno + 1;
+
+        // every freelist record is an array of page numbers prefixed with its length
+        auto txn = this->begin();
+        constexpr MDB_dbi free_dbi = 0;
+        txn.for_each(free_dbi, [&](std::string_view, blob<std::byte> value) {
+            std::size_t count;
+            std::memcpy(&count, value.data(), sizeof(count));
+            out.free_pages += count;
+        });
+
+        int fd;
+        struct stat file_stat;
+        if (::mdb_env_get_fd(this->_handle, &fd) != MDB_SUCCESS || ::fstat(fd, &file_stat) != 0)
+            throw std::runtime_error { "mdb: failed to stat file" };
+        out.file_size = file_stat.st_size;
+        out.allocated_size = std::size_t(file_stat.st_blocks) * 512;
+
+        return out;
+    }
+
+    // the weights database is a record in the unnamed one, so it is not counted
+    size_t size() const
+    {
+        return lmdb::size() - (this->weights_dbi ? 1 : 0);
+    }
+
+    void set_weights(const std::vector<std::pair<std::string, float>>& weights)
+    {
+        if (!this->weights_dbi)
+            throw std::runtime_error { "database is not writeable" };
+        this->write([&](txn& txn) {
+            for (auto [key, weight] : weights)
+                txn.put(key, blob<float> { { sizeof(float), &weight } }, *this->weights_dbi);
+        });
+    }
+
+    std::optional<float> get_weight(std::string_view key)
+    {
+        if (!this->weights_dbi)
+            return std::nullopt;
+        auto txn = this->begin();
+        auto value = txn.get(key, *this->weights_dbi);
+        if (!value)
+            return std::nullopt;
+
+        float weight;
+        std::memcpy(&weight, value->data(), sizeof(float));
+        return weight;
+    }
+
+    // uniform over all keys, or proportional to the weights stored with set_weights
+    sampler make_sampler(bool weighted = false, std::optional<std::uint64_t> seed = std::nullopt)
+    {
+        return sampler {
+            [this] { return this->begin(); }, this->weights_dbi, weighted, seed.value_or(std::random_device {}())
+        };
+    }
+
+    // draws n keys and decodes their images into out, like getmulti
+    std::vector<std::string_view>
+    sample(sampler& source, std::size_t n, std::byte* out, std::optional<std::size_t> stride = std::nullopt)
+    {
+        auto keys = source.sample(n);
+        this->getmulti(keys, out, stride);
+        return keys;
+    }
+
+    void start_write_queue(write_queue_options options = {})
+    {
+        std::unique_lock<std::mutex> lock(*this->writes_mutex);
+        if (this->writes)
+            throw std::runtime_error { "write queue already started" };
+        this->writes = std::make_shared<write_queue>(this->_handle, *this->map, options);
+    }
+
+    // commits everything still pending before returning, throws if syncing those commits failed
+    void stop_write_queue()
+    {
+        if (auto writes = this->_take_write_queue())
+            writes->close();
+    }
+
+    void flush_write_queue()
+    {
+        if (auto writes = this->_write_queue())
+            writes->flush();
+    }
+
+    // compresses on the calling thread, the returned future completes once the write has been committed
+    std::future<void> put_async(
+        std::string_view key,
+        uint16_t mode,
+        uint16_t height,
+        uint16_t width,
+        uint16_t channels,
+        const void* data,
+        size_t nbytes)
+    {
+        // holding on to the queue keeps it alive if another thread stops it meanwhile, enqueue throws then
+        auto writes = this->_write_queue();
+        if (!writes)
+            throw std::runtime_error { "write queue not started" };
+
+        // a key LMDB rejects would fail the whole batch it ends up in
+        check_key(key);
+        auto max_key_size = static_cast<std::size_t>(::mdb_env_get_maxkeysize(this->_handle));
+        if (key.empty() || key.size() > max_key_size)
+            throw std::invalid_argument { "key must be between 1 and " + std::to_string(max_key_size) + " bytes" };
+        auto buffer = this->_compress(mode, height, width, channels, data, nbytes);
+        return writes->enqueue(std::string { key }, std::move(buffer));
+    }
+
+    bool contains(const key_type& key)
+    {
+        auto key_ = to_key(key);
+        check_key(key_);
+        auto txn = this->begin();
+        return static_cast<bool>(txn.get(key_));
+    }
+
+    void put(const key_type& key, const image& value, uint16_t mode = codec::zstd)
+    {
+        auto buffer = this->_compress(
+            mode, value.height, value.width, value.channels, value.data.data(), value.data.size());
+        auto key_ = to_key(key);
+        check_key(key_);
+        this->write([&](txn& txn) { txn.put(key_, buffer); });
+    }
+
+    // compresses everything first, then writes it all in one transaction
+    void putmulti(const std::vector<std::pair<key_type, image>>& items, uint16_t mode = codec::zstd)
+    {
+        std::vector<std::string> keys(items.size());
+        std::vector<std::vector<std::byte>> values(items.size());
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            auto& [key, value] = items[i];
+            keys[i] = to_key(key);
+            check_key(keys[i]);
+            values[i] = this->_compress(
+                mode, value.height, value.width, value.channels, value.data.data(), value.data.size());
+        }
+
+        this->write([&](txn& txn) {
+            for (size_t i = 0; i < items.size(); i++)
+                txn.put(keys[i], values[i]);
+        });
+    }
+
     std::optional<image_dim> get_image_dimension(std::string_view key)
     {
+        check_key(key);
         auto txn = this->begin();
         auto value = txn.get(key);
         if (!value)
@@ -365,98 +1233,380 @@ public:
         return this->get_image_dimension(key_);
     }
 
+    // safe to call from several threads at once
     std::optional<image> get(std::string_view key, std::byte* out = nullptr)
+    {
+        return this->_get(key, out, caller_thread);
+    }
+
+    std::optional<image> get(int64_t key, std::byte* const out = nullptr)
+    {
+        auto key_ = std::to_string(key);
+        return this->get(key_, out);
+    }
+
+    // decodes on the thread pool, the iidb has to outlive the returned future
+    std::future<std::optional<image>> get_async(const key_type& key, std::byte* out = nullptr)
+    {
+        this->_init_zstd_contexts();
+
+        auto promise = std::make_shared<std::promise<std::optional<image>>>();
+        auto future = promise->get_future();
+        this->pool->enqueue([this, key = to_key(key), out, promise](size_t thread_idx) {
+            try
+            {
+                promise->set_value(this->_get(key, out, thread_idx));
+            }
+            catch (...)
+            {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return future;
+    }
+
+    // Keys can be integers, strings or key_type. Images are decoded back to back into out, or `stride` bytes apart.
+    template <typename Key>
+    void getmulti(const std::vector<Key>& keys, std::byte* out, std::optional<std::size_t> stride = std::nullopt)
     {
         auto txn = this->begin();
-        auto value = txn.get(key);
-        if (!value)
-            return std::nullopt;
+        this->getmulti(this->_lookup(txn, keys), out, stride);
+    }
 
-        const std::uint16_t* header = reinterpret_cast<const uint16_t*>(value->data());
-        auto mode = header[0];
-        auto height = header[1];
-        auto width = header[2];
-        auto channels = header[3];
-        auto total_size = width * height * channels;  // in bytes
-        std::vector<std::byte> uncompressed;
+    // decodes values that were already looked up, they must stay valid until this returns
+    void getmulti(
+        const std::vector<blob<std::byte>>& blobs,
+        std::byte* out,
+        std::optional<std::size_t> stride = std::nullopt)
+    {
+        auto dests = this->_destinations(blobs, out, stride);
 
-        if (!out)
+        this->pool->parallel_for(0, blobs.size(), [&](size_t i, size_t thread_idx) {
+            const auto& blob = blobs[i];
+            auto [out_ptr, out_size] = dests[i];
+
+            this->_decompress(out_ptr, out_size, blob.data(), blob.size(), thread_idx);
+        });
+    }
+
+    // like getmulti, but returns once the lookups are done and decodes on the thread pool; out has to stay valid and
+    // the iidb alive until the future completes
+    template <typename Key>
+    std::future<void>
+    getmulti_async(const std::vector<Key>& keys, std::byte* out, std::optional<std::size_t> stride = std::nullopt)
+    {
+        auto batch = std::make_shared<async_batch>(this->begin());
+        batch->blobs = this->_lookup(batch->snapshot, keys);
+        batch->dests = this->_destinations(batch->blobs, out, stride);
+        batch->remaining = batch->blobs.size();
+
+        auto future = batch->done.get_future();
+        if (batch->blobs.empty())
+            batch->done.set_value();
+
+        for (size_t i = 0; i < batch->blobs.size(); i++)
         {
-            uncompressed.resize(total_size);
-            out = uncompressed.data();
+            this->pool->enqueue([this, batch, i](size_t thread_idx) {
+                try
+                {
+                    const auto& blob = batch->blobs[i];
+                    auto [out_ptr, out_size] = batch->dests[i];
+                    this->_decompress(out_ptr, out_size, blob.data(), blob.size(), thread_idx);
+                }
+                catch (...)
+                {
+                    std::unique_lock<std::mutex> lock(batch->error_mutex);
+                    if (!batch->error)
+                        batch->error = std::current_exception();
+                }
+
+                if (--batch->remaining == 0)
+                {
+                    // the caller may close the iidb as soon as the future is ready, so nothing may touch it after
+                    batch->snapshot.abort();
+                    if (batch->error)
+                        batch->done.set_exception(batch->error);
+                    else
+                        batch->done.set_value();
+                }
+            });
         }
 
-        // create zstd contexts
-        if (mode == 0)
+        return future;
+    }
+
+    // Like getmulti, but returns by the deadline with whatever was decoded instead of throwing. Images are started
+    // largest first and an image is never started after the deadline, though the ones already being decoded are
+    // waited for. Without a stride, missing images take up no space in out.
+    template <typename Key>
+    std::vector<read_status> getmulti_until(
+        const std::vector<Key>& keys,
+        std::chrono::steady_clock::time_point deadline,
+        std::byte* out,
+        std::optional<std::size_t> stride = std::nullopt,
+        miss_policy policy = miss_policy::zero)
+    {
+        auto txn = this->begin();
+        return this->getmulti_until(this->_lookup(txn, keys, policy), deadline, out, stride, policy);
+    }
+
+    // missing values are empty optionals, the rest must stay valid until this returns
+    std::vector<read_status> getmulti_until(
+        const std::vector<std::optional<blob<std::byte>>>& blobs,
+        std::chrono::steady_clock::time_point deadline,
+        std::byte* out,
+        std::optional<std::size_t> stride = std::nullopt,
+        miss_policy policy = miss_policy::zero)
+    {
+        // queued decodes may outlive this call after a timeout, so they only hold on to the batch
+        auto batch = std::make_shared<deadline_batch>(blobs.size(), deadline);
+
+        bool uses_zstd = false;
+        std::vector<size_t> order;
+        for (size_t i = 0; i < blobs.size(); i++)
+        {
+            auto& item = batch->items[i];
+            std::size_t total_size = 0;
+            if (blobs[i])
+            {
+                auto header = reinterpret_cast<const uint16_t*>(blobs[i]->data());
+                uses_zstd |= (header[0] & codec::mask) == codec::zstd;
+                total_size = header[1] * header[2] * header[3];
+                item.src = blobs[i]->data();
+                item.src_size = blobs[i]->size();
+                item.state = deadline_batch::pending;
+                order.push_back(i);
+            }
+            else
+                item.state = static_cast<std::uint8_t>(read_status::missing);
+
+            item.dest = out;
+            item.dest_size = stride.value_or(total_size);
+            out += item.dest_size;
+        }
+
+        if (uses_zstd)
             this->_init_zstd_contexts();
 
-        this->_decompress(mode, out, total_size, value->data(), value->size(), 0);
+        // the compressed size is the best guess we have for how long an image takes to decode
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return blobs[a]->size() > blobs[b]->size();
+        });
 
-        return image { std::move(uncompressed), height, width, channels };
+        batch->remaining = order.size();
+        for (auto i : order)
+        {
+            this->pool->enqueue([this, batch, i](size_t thread_idx) {
+                auto& item = batch->items[i];
+                auto status = read_status::timed_out;
+                std::uint8_t expected = deadline_batch::pending;
+                if (std::chrono::steady_clock::now() >= batch->deadline)
+                {
+                    if (!item.state.compare_exchange_strong(expected, static_cast<std::uint8_t>(status)))
+                        return;  // already marked by the caller
+                }
+                else
+                {
+                    if (!item.state.compare_exchange_strong(expected, deadline_batch::running))
+                        return;
+
+                    status = read_status::ok;
+                    try
+                    {
+                        this->_decompress(item.dest, item.dest_size, item.src, item.src_size, thread_idx);
+                    }
+                    catch (...)
+                    {
+                        status = read_status::failed;
+                    }
+                    item.state = static_cast<std::uint8_t>(status);
+                }
+
+                std::unique_lock<std::mutex> lock(batch->mutex);
+                if (--batch->remaining == 0)
+                    batch->finished.notify_all();
+            });
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(batch->mutex);
+            if (!batch->finished.wait_until(lock, deadline, [&] { return batch->remaining == 0; }))
+            {
+                for (auto& item : batch->items)
+                {
+                    std::uint8_t expected = deadline_batch::pending;
+                    if (item.state.compare_exchange_strong(
+                            expected, static_cast<std::uint8_t>(read_status::timed_out)))
+                        batch->remaining--;
+                }
+
+                // images already being decoded write into out, so they have to finish before we return
+                batch->finished.wait(lock, [&] { return batch->remaining == 0; });
+            }
+        }
+
+        std::vector<read_status> statuses(blobs.size());
+        for (size_t i = 0; i < blobs.size(); i++)
+        {
+            auto& item = batch->items[i];
+            statuses[i] = static_cast<read_status>(item.state.load());
+            if (statuses[i] != read_status::ok && policy == miss_policy::zero && item.dest_size > 0)
+                std::memset(item.dest, 0, item.dest_size);
+        }
+        return statuses;
     }
 
-    std::optional<image> get(int64_t key, std::byte* const out = nullptr)
+protected:
+    std::shared_ptr<write_queue> _write_queue()
     {
-        auto key_ = std::to_string(key);
-        return this->get(key_, out);
+        std::unique_lock<std::mutex> lock(*this->writes_mutex);
+        return this->writes;
     }
 
-    void getmulti(const std::vector<int64_t>& keys, std::byte* out, std::optional<std::size_t> stride = std::nullopt)
+    std::shared_ptr<write_queue> _take_write_queue()
     {
-        std::vector<blob<std::byte>> blobs(keys.size());
-        std::vector<image_dim> image_dims(keys.size());
+        if (!this->writes_mutex)  // moved from
+            return nullptr;
+        std::unique_lock<std::mutex> lock(*this->writes_mutex);
+        return std::move(this->writes);
+    }
 
-        std::uint16_t mode = 0;
+    // thread index for decoding outside of the thread pool
+    static constexpr std::size_t caller_thread = std::numeric_limits<std::size_t>::max();
 
-        auto txn = this->begin();
+    struct async_batch
+    {
+        async_batch(txn&& snapshot)
+            : snapshot(std::move(snapshot))
+        { }
+
+        txn snapshot;  // keeps the looked up values valid until the last image is decoded
+        std::vector<blob<std::byte>> blobs;
+        std::vector<std::pair<std::byte*, std::size_t>> dests;
+        std::atomic<std::size_t> remaining;
+        std::promise<void> done;
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    struct deadline_batch
+    {
+        // item states besides the final read_status values
+        static constexpr std::uint8_t pending = 0xfe;
+        static constexpr std::uint8_t running = 0xff;
+
+        struct item
+        {
+            const std::byte* src = nullptr;
+            std::size_t src_size = 0;
+            std::byte* dest = nullptr;
+            std::size_t dest_size = 0;
+            std::atomic<std::uint8_t> state;
+        };
+
+        deadline_batch(std::size_t size, std::chrono::steady_clock::time_point deadline)
+            : items(size)
+            , deadline(deadline)
+        { }
+
+        std::vector<item> items;
+        const std::chrono::steady_clock::time_point deadline;
+        std::size_t remaining;  // guarded by mutex
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    template <typename Key>
+    std::vector<blob<std::byte>> _lookup(txn& txn, const std::vector<Key>& keys)
+    {
+        std::vector<blob<std::byte>> blobs(keys.size());
         for (size_t i = 0; i < keys.size(); i++)
         {
-            auto key = keys[i];
-            auto key_ = std::to_string(key);
+            auto key_ = to_key(keys[i]);
+            check_key(key_);
             auto value = txn.get(key_);
             if (!value)
                 throw std::out_of_range { "key not found: " + key_ };
             blobs[i] = *value;
-
-            auto header = reinterpret_cast<const uint16_t*>(value->data());
-            mode = header[0];
-            image_dims[i].height = header[1];
-            image_dims[i].width = header[2];
-            image_dims[i].channels = header[3];
         }
+        return blobs;
+    }
 
-        // in serial, calculate the destination pointer addresses
-        std::vector<std::pair<std::byte*, std::size_t>> dests(keys.size());
+    // missing keys are empty, unless the policy is to raise
+    template <typename Key>
+    std::vector<std::optional<blob<std::byte>>> _lookup(txn& txn, const std::vector<Key>& keys, miss_policy policy)
+    {
+        std::vector<std::optional<blob<std::byte>>> blobs(keys.size());
         for (size_t i = 0; i < keys.size(); i++)
         {
-            const auto& dim = image_dims[i];
-            std::size_t total_size = stride.value_or(dim.width * dim.height * dim.channels);  // in bytes
+            auto key_ = to_key(keys[i]);
+            check_key(key_);
+            blobs[i] = txn.get(key_);
+            if (!blobs[i] && policy == miss_policy::raise)
+                throw std::out_of_range { "key not found: " + key_ };
+        }
+        return blobs;
+    }
+
+    // in serial, calculate the destination pointer addresses
+    std::vector<std::pair<std::byte*, std::size_t>>
+    _destinations(const std::vector<blob<std::byte>>& blobs, std::byte* out, std::optional<std::size_t> stride)
+    {
+        bool uses_zstd = false;
+
+        std::vector<std::pair<std::byte*, std::size_t>> dests(blobs.size());
+        for (size_t i = 0; i < blobs.size(); i++)
+        {
+            auto header = reinterpret_cast<const uint16_t*>(blobs[i].data());
+            uses_zstd |= (header[0] & codec::mask) == codec::zstd;
+            std::size_t total_size = stride.value_or(header[1] * header[2] * header[3]);  // in bytes
             dests[i] = { out, total_size };
             out += total_size;
         }
 
         // create zstd contexts
-        if (mode == 0)
+        if (uses_zstd)
             this->_init_zstd_contexts();
 
-        this->pool->parallel_for(0, blobs.size(), [&](size_t i, size_t thread_idx) {
-            const auto& blob = blobs[i];
-            auto [out_ptr, out_size] = dests[i];
+        return dests;
+    }
 
-            this->_decompress(mode, out_ptr, out_size, blob.data(), blob.size(), thread_idx);
-        });
+    std::optional<image> _get(std::string_view key, std::byte* out, std::size_t thread_idx)
+    {
+        check_key(key);
+        auto txn = this->begin();
+        auto value = txn.get(key);
+        if (!value)
+            return std::nullopt;
+
+        const std::uint16_t* header = reinterpret_cast<const uint16_t*>(value->data());
+        auto mode = header[0];
+        auto height = header[1];
+        auto width = header[2];
+        auto channels = header[3];
+        auto total_size = width * height * channels;  // in bytes
+        std::vector<std::byte> uncompressed;
+
+        if (!out)
+        {
+            uncompressed.resize(total_size);
+            out = uncompressed.data();
+        }
+
+        // create zstd contexts
+        if ((mode & codec::mask) == codec::zstd)
+            this->_init_zstd_contexts();
+
+        this->_decompress(out, total_size, value->data(), value->size(), thread_idx);
+
+        return image { std::move(uncompressed), height, width, channels };
     }
 
-protected:
     void _init_zstd_contexts()
     {
+        std::unique_lock<std::mutex> lock(*this->zstd_contexts_mutex);
         if (this->zstd_dcontexts.size() == 0)
         {
-            // create compression context
-            this->zstd_ccontexts.resize(1);
-            this->zstd_ccontexts[0].reset(ZSTD_createCCtx());
-            ZSTD_CCtx_setParameter(this->zstd_ccontexts[0].get(), ZSTD_c_nbWorkers, 4);
-
             // create decompression contexts
             this->zstd_dcontexts.resize(this->pool->num_threads());
             for (auto i = 0u; i < this->pool->num_threads(); i++)
@@ -464,6 +1614,53 @@ protected:
         }
     }
 
+    // compression contexts are handed out one per concurrent compressor, so producers can compress in parallel
+    std::unique_ptr<ZSTD_CCtx, deleter<ZSTD_freeCCtx>> _acquire_zstd_ccontext()
+    {
+        {
+            std::unique_lock<std::mutex> lock(*this->zstd_contexts_mutex);
+            if (!this->zstd_ccontexts.empty())
+            {
+                auto cctx = std::move(this->zstd_ccontexts.back());
+                this->zstd_ccontexts.pop_back();
+                return cctx;
+            }
+        }
+
+        std::unique_ptr<ZSTD_CCtx, deleter<ZSTD_freeCCtx>> cctx { ZSTD_createCCtx() };
+        ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_nbWorkers, 4);
+        return cctx;
+    }
+
+    void _release_zstd_ccontext(std::unique_ptr<ZSTD_CCtx, deleter<ZSTD_freeCCtx>> cctx)
+    {
+        ZSTD_CCtx_reset(cctx.get(), ZSTD_reset_session_only);
+        std::unique_lock<std::mutex> lock(*this->zstd_contexts_mutex);
+        this->zstd_ccontexts.push_back(std::move(cctx));
+    }
+
+    // pool threads own a decompression context each, everybody else borrows one
+    std::unique_ptr<ZSTD_DCtx, deleter<ZSTD_freeDCtx>> _acquire_zstd_dcontext()
+    {
+        {
+            std::unique_lock<std::mutex> lock(*this->zstd_contexts_mutex);
+            if (!this->zstd_caller_dcontexts.empty())
+            {
+                auto dctx = std::move(this->zstd_caller_dcontexts.back());
+                this->zstd_caller_dcontexts.pop_back();
+                return dctx;
+            }
+        }
+
+        return std::unique_ptr<ZSTD_DCtx, deleter<ZSTD_freeDCtx>> { ZSTD_createDCtx() };
+    }
+
+    void _release_zstd_dcontext(std::unique_ptr<ZSTD_DCtx, deleter<ZSTD_freeDCtx>> dctx)
+    {
+        std::unique_lock<std::mutex> lock(*this->zstd_contexts_mutex);
+        this->zstd_caller_dcontexts.push_back(std::move(dctx));
+    }
+
     void _set_header(void* bytes, uint16_t mode, uint16_t height, uint16_t width, uint16_t channels)
     {
         auto header = reinterpret_cast<uint16_t*>(bytes);
@@ -476,21 +1673,39 @@ protected:
     std::vector<std::byte>
     _compress(uint16_t mode, uint16_t height, uint16_t width, uint16_t channels, const void* data, size_t nbytes)
     {
+        filters::validate(mode);
+
+        // filter into a temporary so the codec sees the filtered pixels
+        std::vector<std::byte> filtered;
+        if (mode & filters::mask)
+        {
+            filtered.resize(nbytes);
+            filters::encode(
+                mode,
+                reinterpret_cast<const std::uint8_t*>(data),
+                reinterpret_cast<std::uint8_t*>(filtered.data()),
+                height,
+                width,
+                channels);
+            data = filtered.data();
+        }
+
         std::vector<std::byte> buffer;
+        auto codec_ = mode & codec::mask;
 
-        if (mode == 0)
+        if (codec_ == codec::zstd)
         {
-            this->_init_zstd_contexts();
+            auto cctx = this->_acquire_zstd_ccontext();
             auto compress_bound_size = ZSTD_compressBound(nbytes);
             buffer.resize(compress_bound_size + 8);
             this->_set_header(buffer.data(), mode, height, width, channels);
-            auto compressed_nbytes = ZSTD_compressCCtx(
-                this->zstd_ccontexts[0].get(), buffer.data() + 8, compress_bound_size, data, nbytes, 7);
+            auto compressed_nbytes
+                = ZSTD_compressCCtx(cctx.get(), buffer.data() + 8, compress_bound_size, data, nbytes, 7);
             buffer.resize(compressed_nbytes + 8);
-            ZSTD_CCtx_reset(this->zstd_ccontexts[0].get(), ZSTD_reset_session_only);
+            this->_release_zstd_ccontext(std::move(cctx));
         }
 
-        else if (mode == 1)
+        else if (codec_ == codec::lz4)
         {
             auto compress_bound_size = LZ4_compressBound(nbytes);
             buffer.resize(compress_bound_size + 8);
@@ -504,26 +1719,84 @@ protected:
             buffer.resize(compressed_nbytes + 8);
         }
 
+        else
+            throw std::invalid_argument { "unknown codec" };
+
         return buffer;
     }
 
-    void
-    _decompress(int mode, std::byte* dest, size_t dest_size, const std::byte* src, size_t src_size, size_t thread_idx)
+    void _decompress(std::byte* dest, size_t dest_size, const std::byte* src, size_t src_size, size_t thread_idx)
     {
-        if (mode == 0)
+        auto header = reinterpret_cast<const uint16_t*>(src);
+        auto mode = header[0];
+        auto height = header[1];
+        auto width = header[2];
+        auto channels = header[3];
+
+        // filters always write the whole image, so a short dest would overflow instead of truncating
+        auto image_size = std::size_t(height) * width * channels;
+        if (dest_size < image_size)
+            throw std::invalid_argument { "image does not fit in the destination" };
+
+        // planar data has to be decompressed somewhere else before it is interleaved into dest
+        thread_local std::vector<std::byte> planes;
+        auto out = dest;
+        auto out_size = dest_size;
+        if (mode & (filters::planar | filters::ycocg))
         {
-            ZSTD_decompressDCtx(this->zstd_dcontexts[thread_idx].get(), dest, dest_size, src + 8, src_size - 8);
+            planes.resize(image_size);
+            out = planes.data();
+            out_size = planes.size();
+        }
+
+        // a value that doesn't decode to exactly the image its header describes is corrupt
+        if ((mode & codec::mask) == codec::zstd)
+        {
+            std::size_t decoded;
+            if (thread_idx < this->zstd_dcontexts.size())
+                decoded = ZSTD_decompressDCtx(
+                    this->zstd_dcontexts[thread_idx].get(), out, out_size, src + 8, src_size - 8);
+            else
+            {
+                auto dctx = this->_acquire_zstd_dcontext();
+                decoded = ZSTD_decompressDCtx(dctx.get(), out, out_size, src + 8, src_size - 8);
+                this->_release_zstd_dcontext(std::move(dctx));
+            }
+            if (ZSTD_isError(decoded))
+                throw std::runtime_error { std::string { "zstd: failed to decompress: " }
+                                           + ZSTD_getErrorName(decoded) };
+            if (decoded != image_size)
+                throw std::runtime_error { "zstd: decompressed size does not match the image" };
         }
         else
         {
-            LZ4_decompress_safe(
-                reinterpret_cast<const char*>(src + 8), reinterpret_cast<char*>(dest), src_size - 8, dest_size);
+            auto decoded = LZ4_decompress_safe(
+                reinterpret_cast<const char*>(src + 8), reinterpret_cast<char*>(out), src_size - 8, out_size);
+            if (decoded < 0 || std::size_t(decoded) != image_size)
+                throw std::runtime_error { "lz4: failed to decompress" };
         }
+
+        if (mode & filters::mask)
+            filters::decode(
+                mode,
+                reinterpret_cast<std::uint8_t*>(out),
+                reinterpret_cast<std::uint8_t*>(dest),
+                height,
+                width,
+                channels);
     }
 
     std::vector<std::unique_ptr<ZSTD_CCtx, deleter<ZSTD_freeCCtx>>> zstd_ccontexts;
     std::vector<std::unique_ptr<ZSTD_DCtx, deleter<ZSTD_freeDCtx>>> zstd_dcontexts;
+    std::vector<std::unique_ptr<ZSTD_DCtx, deleter<ZSTD_freeDCtx>>> zstd_caller_dcontexts;
+    std::unique_ptr<std::mutex> zstd_contexts_mutex { new std::mutex };
     std::unique_ptr<thread_pool> pool;
+    std::unique_ptr<map_resizer> map;
+    // opened once by the constructor, missing when a read-only database has no weights
+    std::optional<MDB_dbi> weights_dbi;
+    // declared last so pending writes are committed before anything else is torn down
+    std::unique_ptr<std::mutex> writes_mutex { new std::mutex };
+    std::shared_ptr<write_queue> writes;
 };
 
 static_assert(std::is_move_constructible_v<iidb>);
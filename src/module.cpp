@@ -1,4 +1,5 @@
 #include "../iidb.hpp"
+#include <chrono>
 #include <condition_variable>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
@@ -18,26 +19,61 @@ using std::vector;
 #define MACRO_STRINGIFY(x) STRINGIFY(x)
 
 typedef py::array_t<uint8_t, py::array::c_style | py::array::forcecast> array_type;
-typedef std::variant<int64_t, string_view> generic_key_type;
+typedef ::iidb::key_type generic_key_type;
+using ::iidb::to_key;
 
-string preprocess_key(const generic_key_type& key)
+// the numpy shape of n images, or of a single one when n is not given
+static vector<py::ssize_t> image_shape(::iidb::image_dim dim, std::optional<size_t> n = std::nullopt)
 {
-    return std::visit(
-        [](auto&& arg) {
-            using T = std::decay_t<decltype(arg)>;
-            if constexpr (std::is_same_v<T, int64_t>)
-                return std::to_string(arg);
-            else  // string_view
-                return std::string { arg };
-        },
-        key);
+    vector<py::ssize_t> shape;
+    if (n)
+        shape.push_back(py::ssize_t(*n));
+    shape.push_back(dim.height);
+    shape.push_back(dim.width);
+    if (dim.channels != 1)
+        shape.push_back(dim.channels);
+    return shape;
 }
 
+// Images are decoded with the GIL released into memory numpy then takes over, since allocating the array needs the
+// GIL and waiting for it while a transaction is open could keep the map from growing indefinitely.
+static array_type to_array(std::unique_ptr<std::byte[]> data, const vector<py::ssize_t>& shape)
+{
+    py::capsule owner(data.get(), [](void* p) { delete[] reinterpret_cast<std::byte*>(p); });
+    return array_type(shape, reinterpret_cast<const uint8_t*>(data.release()), owner);
+}
+
+class py_write_future
+{
+public:
+    py_write_future(std::future<void>&& future)
+        : future(future.share())
+    { }
+
+    bool done() const
+    {
+        return this->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    // rethrows any error raised while committing
+    void result()
+    {
+        {
+            py::gil_scoped_release release;
+            this->future.wait();
+        }
+        this->future.get();
+    }
+
+private:
+    std::shared_future<void> future;
+};
+
 class py_iidb : public ::iidb::iidb
 {
 public:
-    py_iidb(string_view path, bool readonly, int mode)
-        : ::iidb::iidb(path, !readonly)
+    py_iidb(string_view path, bool readonly, int mode, size_t map_size, double map_growth, size_t map_max_size)
+        : ::iidb::iidb(path, !readonly, ::iidb::map_options { map_size, map_growth, map_max_size })
         , path(path)
         , readonly(readonly)
         , mode(mode)
@@ -56,8 +92,16 @@ public:
         this->close();
     }
 
+    // everything below that opens a transaction does so without the GIL, see to_array
+    void close()
+    {
+        py::gil_scoped_release release;
+        ::iidb::iidb::close();
+    }
+
     bool contains(int64_t key)
     {
+        py::gil_scoped_release release;
         auto txn = this->begin();
         auto key_ = std::to_string(key);
         auto value = txn.get(key_);
@@ -67,15 +111,19 @@ public:
     std::variant<pair<int, int>, tuple<int, int, int>> get_image_dimension(int64_t key)
     {
         auto key_ = std::to_string(key);
-        auto txn = this->begin();
-        auto value = txn.get(key_);
-        if (!value)
-            throw std::out_of_range { "key not found: " + key_ };
+        int height, width, channels;
+        {
+            py::gil_scoped_release release;
+            auto txn = this->begin();
+            auto value = txn.get(key_);
+            if (!value)
+                throw std::out_of_range { "key not found: " + key_ };
 
-        const uint16_t* header = reinterpret_cast<const uint16_t*>(value->data());
-        int height = header[1];
-        int width = header[2];
-        int channels = header[3];
+            const uint16_t* header = reinterpret_cast<const uint16_t*>(value->data());
+            height = header[1];
+            width = header[2];
+            channels = header[3];
+        }
 
         if (channels == 1)
             return pair(height, width);
@@ -85,30 +133,29 @@ public:
 
     array_type get(string_view key)
     {
-        auto txn = this->begin();
-        auto value = txn.get(key);
-        if (!value)
-            throw std::out_of_range { "key not found: " + std::string(key) };
-
-        const uint16_t* header = reinterpret_cast<const uint16_t*>(value->data());
-        int mode = header[0];
-        int height = header[1];
-        int width = header[2];
-        int channels = header[3];
+        std::unique_ptr<std::byte[]> out;
+        ::iidb::image_dim image_dim;
+        {
+            py::gil_scoped_release release;
+            ::iidb::check_key(key);
+            auto txn = this->begin();
+            auto value = txn.get(key);
+            if (!value)
+                throw std::out_of_range { "key not found: " + std::string(key) };
 
-        array_type out;
-        if (channels == 1)
-            out.resize({ height, width });
-        else
-            out.resize({ height, width, channels });
-        auto out_ptr = reinterpret_cast<std::byte*>(out.request().ptr);
+            const uint16_t* header = reinterpret_cast<const uint16_t*>(value->data());
+            int mode = header[0];
+            image_dim = { header[1], header[2], header[3] };
+            size_t image_nbytes = size_t(image_dim.height) * image_dim.width * image_dim.channels;
+            out.reset(new std::byte[image_nbytes]);
 
-        if (mode == 0)
-            this->_init_zstd_contexts();
+            if ((mode & ::iidb::codec::mask) == ::iidb::codec::zstd)
+                this->_init_zstd_contexts();
 
-        this->_decompress(mode, out_ptr, out.nbytes(), value->data(), value->size(), 0);
+            this->_decompress(out.get(), image_nbytes, value->data(), value->size(), caller_thread);
+        }
 
-        return out;
+        return to_array(std::move(out), image_shape(image_dim));
     }
 
     array_type get(int64_t key)
@@ -125,10 +172,10 @@ public:
         uint16_t width = buffer_info.shape[1];
         uint16_t channels = buffer_info.ndim == 2 ? 1 : buffer_info.shape[2];
 
+        py::gil_scoped_release release;
+        ::iidb::check_key(key);
         auto buffer = this->_compress(this->mode, height, width, channels, src_ptr, src_nbytes);
-        auto txn = this->begin(true);
-        txn.put(key, buffer);
-        txn.commit();
+        this->write([&](::iidb::txn& txn) { txn.put(key, buffer); });
     }
 
     void put(int64_t key, array_type value)
@@ -136,60 +183,149 @@ public:
         this->put(std::to_string(key), value);
     }
 
-    array_type getmulti(const vector<generic_key_type>& keys)
+    void start_write_queue(
+        double max_delay_ms,
+        size_t max_batch_items,
+        size_t max_batch_bytes,
+        bool nosync,
+        bool nometasync)
     {
-        vector<::iidb::blob<std::byte>> blobs(keys.size());
-        vector<::iidb::image_dim> image_dims(keys.size());
+        ::iidb::write_queue_options options;
+        options.max_delay = std::chrono::microseconds(static_cast<int64_t>(max_delay_ms * 1000));
+        options.max_batch_items = max_batch_items;
+        options.max_batch_bytes = max_batch_bytes;
+        if (nosync)
+            options.durability = options.durability | ::iidb::openflags::nosync;
+        if (nometasync)
+            options.durability = options.durability | ::iidb::openflags::nometasync;
+
+        ::iidb::iidb::start_write_queue(options);
+    }
 
-        uint16_t mode = 0;
+    py_write_future put_async(const generic_key_type& key, array_type value)
+    {
+        auto key_ = to_key(key);
+        auto src_nbytes = value.nbytes();
+        auto buffer_info = value.request();
+        auto src_ptr = buffer_info.ptr;
+        uint16_t height = buffer_info.shape[0];
+        uint16_t width = buffer_info.shape[1];
+        uint16_t channels = buffer_info.ndim == 2 ? 1 : buffer_info.shape[2];
 
-        auto txn = this->begin();
-        for (size_t i = 0; i < keys.size(); i++)
-        {
-            auto key = preprocess_key(keys[i]);
+        // compress without holding the GIL so that several producer threads can compress at once
+        py::gil_scoped_release release;
+        auto future = ::iidb::iidb::put_async(key_, this->mode, height, width, channels, src_ptr, src_nbytes);
+        return py_write_future { std::move(future) };
+    }
 
-            auto value = txn.get(key);
-            if (!value)
-                throw std::out_of_range { "key not found: " + key };
-            blobs[i] = *value;
+    void flush()
+    {
+        py::gil_scoped_release release;
+        this->flush_write_queue();
+    }
 
-            auto header = reinterpret_cast<const uint16_t*>(value->data());
-            mode = header[0];
-            image_dims[i].height = header[1];
-            image_dims[i].width = header[2];
-            image_dims[i].channels = header[3];
+    void stop_write_queue()
+    {
+        py::gil_scoped_release release;
+        ::iidb::iidb::stop_write_queue();
+    }
+
+    array_type getmulti(const vector<generic_key_type>& keys)
+    {
+        std::unique_ptr<std::byte[]> out;
+        vector<py::ssize_t> shape;
+        {
+            py::gil_scoped_release release;
+            auto txn = this->begin();
+            std::tie(out, shape) = this->_getmulti(this->_lookup(txn, keys));
         }
+        return to_array(std::move(out), shape);
+    }
 
-        // make sure all the images are of the same shape
-        for (size_t i = 1; i < keys.size(); i++)
+    // returns the images along with a status per key, images that were not read are zeros
+    pair<array_type, py::array_t<uint8_t>>
+    getmulti_until(const vector<generic_key_type>& keys, double timeout, int missing)
+    {
+        auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+        // the output is freshly allocated, so skipping would leave garbage behind
+        auto policy = static_cast<::iidb::miss_policy>(missing);
+        if (policy != ::iidb::miss_policy::raise && policy != ::iidb::miss_policy::zero)
+            throw py::value_error { "missing must be MISS_RAISE or MISS_ZERO" };
+
+        std::unique_ptr<std::byte[]> out;
+        vector<py::ssize_t> shape;
+        vector<::iidb::read_status> statuses;
         {
-            if (image_dims[i].width != image_dims[0].width || image_dims[i].height != image_dims[0].height
-                || image_dims[i].channels != image_dims[0].channels)
-                throw std::runtime_error { "images not all the same shape" };
+            // the transaction has to end before the GIL is taken back, see to_array
+            py::gil_scoped_release release;
+            auto txn = this->begin();
+            auto blobs = this->_lookup(txn, keys, policy);
+            std::optional<::iidb::image_dim> image_dim;
+            for (size_t i = 0; i < keys.size(); i++)
+            {
+                if (!blobs[i])
+                    continue;
+
+                // make sure all the images are of the same shape
+                auto header = reinterpret_cast<const uint16_t*>(blobs[i]->data());
+                if (!image_dim)
+                    image_dim = ::iidb::image_dim { header[1], header[2], header[3] };
+                else if (header[1] != image_dim->height || header[2] != image_dim->width
+                         || header[3] != image_dim->channels)
+                    throw std::runtime_error { "images not all the same shape" };
+            }
+            if (!image_dim)
+                image_dim = ::iidb::image_dim { 0, 0, 1 };
+            size_t image_nbytes = size_t(image_dim->width) * image_dim->height * image_dim->channels;
+
+            // zeroed, images that are not read stay that way
+            out.reset(new std::byte[keys.size() * image_nbytes]());
+            shape = image_shape(*image_dim, keys.size());
+            statuses = ::iidb::iidb::getmulti_until(
+                blobs, deadline, out.get(), image_nbytes, ::iidb::miss_policy::zero);
         }
-        auto image_dim = image_dims[0];
-        auto image_nbytes = image_dim.width * image_dim.height * image_dim.channels;
 
-        // create output array
-        array_type out;
-        if (image_dim.channels == 1)
-            out.resize({ int(keys.size()), int(image_dim.height), int(image_dim.width) });
-        else
-            out.resize({ int(keys.size()), int(image_dim.height), int(image_dim.width), int(image_dim.channels) });
-        auto out_ptr = reinterpret_cast<std::byte*>(out.request().ptr);
+        py::array_t<uint8_t> status(statuses.size());
+        auto status_ptr = status.mutable_data();
+        for (size_t i = 0; i < statuses.size(); i++)
+            status_ptr[i] = static_cast<uint8_t>(statuses[i]);
 
-        // create zstd contexts
-        if (mode == 0)
-            this->_init_zstd_contexts();
+        return { to_array(std::move(out), shape), status };
+    }
 
-        this->pool->parallel_for(0, blobs.size(), [&](size_t i, size_t thread_idx) {
-            const auto& blob = blobs[i];
-            auto this_out_ptr = out_ptr + i * image_nbytes;
+    py::dict stats() const
+    {
+        ::iidb::storage_stats stats;
+        {
+            py::gil_scoped_release release;
+            stats = ::iidb::iidb::stats();
+        }
+        py::dict out;
+        out["map_size"] = stats.map_size;
+        out["page_size"] = stats.page_size;
+        out["pages"] = stats.pages;
+        out["free_pages"] = stats.free_pages;
+        out["free_fraction"] = stats.free_fraction();
+        out["file_size"] = stats.file_size;
+        out["allocated_size"] = stats.allocated_size;
+        return out;
+    }
 
-            this->_decompress(mode, this_out_ptr, image_nbytes, blob.data(), blob.size(), thread_idx);
-        });
+    void set_weights(const vector<pair<generic_key_type, float>>& weights)
+    {
+        vector<pair<string, float>> weights_(weights.size());
+        for (size_t i = 0; i < weights.size(); i++)
+            weights_[i] = { to_key(weights[i].first), weights[i].second };
+        py::gil_scoped_release release;
+        ::iidb::iidb::set_weights(weights_);
+    }
 
-        return out;
+    std::optional<float> get_weight(const generic_key_type& key)
+    {
+        auto key_ = to_key(key);
+        py::gil_scoped_release release;
+        return ::iidb::iidb::get_weight(key_);
     }
 
     void putmulti(const vector<pair<generic_key_type, array_type>>& items)
@@ -199,16 +335,25 @@ public:
 
         vector<string> to_insert_keys(items.size());
         vector<vector<std::byte>> to_insert_values(items.size());
-        if (this->mode == 0)
-            this->_init_zstd_contexts();
-
+        vector<py::buffer_info> buffer_infos;
+        buffer_infos.reserve(items.size());
         for (size_t i = 0; i < items.size(); i++)
         {
             auto& [key, value] = items[i];
-            to_insert_keys[i] = preprocess_key(key);
+            to_insert_keys[i] = to_key(key);
+            ::iidb::check_key(to_insert_keys[i]);
+            buffer_infos.push_back(value.request());
+        }
 
-            auto src_nbytes = value.nbytes();
-            auto buffer_info = value.request();
+        // the buffers are released once the GIL is back
+        py::gil_scoped_release release;
+        if ((this->mode & ::iidb::codec::mask) == ::iidb::codec::zstd)
+            this->_init_zstd_contexts();
+
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            const auto& buffer_info = buffer_infos[i];
+            auto src_nbytes = buffer_info.size * buffer_info.itemsize;
             auto src_ptr = buffer_info.ptr;
             uint16_t height = buffer_info.shape[0];
             uint16_t width = buffer_info.shape[1];
@@ -216,33 +361,120 @@ public:
             to_insert_values[i] = this->_compress(this->mode, height, width, channels, src_ptr, src_nbytes);
         };
 
-        auto txn = this->begin(true);
-        for (size_t i = 0; i < items.size(); i++)
-        {
-            txn.put(to_insert_keys[i], to_insert_values[i]);
-        }
-        txn.commit();
+        this->write([&](::iidb::txn& txn) {
+            for (size_t i = 0; i < items.size(); i++)
+            {
+                txn.put(to_insert_keys[i], to_insert_values[i]);
+            }
+        });
     }
 
     const string path;
     const bool readonly;
     const int mode;
+
+protected:
+    // decodes images of one shape back to back and returns them with their numpy shape, called without the GIL
+    pair<std::unique_ptr<std::byte[]>, vector<py::ssize_t>> _getmulti(const vector<::iidb::blob<std::byte>>& blobs)
+    {
+        vector<::iidb::image_dim> image_dims(blobs.size());
+
+        bool uses_zstd = false;
+
+        for (size_t i = 0; i < blobs.size(); i++)
+        {
+            auto header = reinterpret_cast<const uint16_t*>(blobs[i].data());
+            uses_zstd |= (header[0] & ::iidb::codec::mask) == ::iidb::codec::zstd;
+            image_dims[i].height = header[1];
+            image_dims[i].width = header[2];
+            image_dims[i].channels = header[3];
+        }
+
+        // make sure all the images are of the same shape
+        for (size_t i = 1; i < blobs.size(); i++)
+        {
+            if (image_dims[i].width != image_dims[0].width || image_dims[i].height != image_dims[0].height
+                || image_dims[i].channels != image_dims[0].channels)
+                throw std::runtime_error { "images not all the same shape" };
+        }
+        auto image_dim = blobs.empty() ? ::iidb::image_dim { 0, 0, 1 } : image_dims[0];
+        size_t image_nbytes = size_t(image_dim.width) * image_dim.height * image_dim.channels;
+
+        std::unique_ptr<std::byte[]> out { new std::byte[blobs.size() * image_nbytes] };
+        auto out_ptr = out.get();
+
+        // create zstd contexts
+        if (uses_zstd)
+            this->_init_zstd_contexts();
+
+        this->pool->parallel_for(0, blobs.size(), [&](size_t i, size_t thread_idx) {
+            const auto& blob = blobs[i];
+            auto this_out_ptr = out_ptr + i * image_nbytes;
+
+            this->_decompress(this_out_ptr, image_nbytes, blob.data(), blob.size(), thread_idx);
+        });
+
+        return { std::move(out), image_shape(image_dim, blobs.size()) };
+    }
 };
 
 static_assert(std::is_move_constructible_v<py_iidb>);
 
+class py_sampler
+{
+public:
+    py_sampler(py_iidb& db, ::iidb::sampler&& sampler)
+        : db(db)
+        , sampler(std::move(sampler))
+    { }
+
+    size_t size() const
+    {
+        return this->sampler.size();
+    }
+
+    vector<string_view> sample_keys(size_t n)
+    {
+        return this->sampler.sample(n);
+    }
+
+    // keys removed since the sampler was made raise like missing keys in getmulti
+    pair<vector<string_view>, array_type> sample(size_t n)
+    {
+        auto keys = this->sampler.sample(n);
+        return { keys, this->db.getmulti(vector<generic_key_type>(keys.begin(), keys.end())) };
+    }
+
+private:
+    py_iidb& db;
+    ::iidb::sampler sampler;
+};
+
 PYBIND11_MODULE(iidb, m)
 {
     using namespace pybind11::literals;
 
+    py::class_<py_write_future>(m, "WriteFuture")
+        .def("done", &py_write_future::done, "")
+        .def("result", &py_write_future::result, "");
+
     py::class_<py_iidb>(m, "IIDB")
-        .def(py::init<string_view, bool, int>(), "", "path"_a, "readonly"_a = true, "mode"_a = 0)
+        .def(
+            py::init<string_view, bool, int, size_t, double, size_t>(),
+            "",
+            "path"_a,
+            "readonly"_a = true,
+            "mode"_a = 0,
+            "map_size"_a = size_t(1) << 30,
+            "map_growth"_a = 2.0,
+            "map_max_size"_a = 0)
         .def_property_readonly("closed", &py_iidb::closed, "")
         .def("close", &py_iidb::close, "")
         .def("__enter__", &py_iidb::__enter__, "")
         .def("__exit__", &py_iidb::__exit__, "")
         .def("__contains__", &py_iidb::contains, "", "key"_a)
         .def("__len__", &py_iidb::size, "")
+        .def("stats", &py_iidb::stats, "")
         .def("get_image_dimension", &py_iidb::get_image_dimension, "", "key"_a)
         .def("get", py::overload_cast<string_view>(&py_iidb::get), "", "key"_a)
         .def("get", py::overload_cast<int64_t>(&py_iidb::get), "", "key"_a)
@@ -251,15 +483,69 @@ PYBIND11_MODULE(iidb, m)
         .def("__setitem__", py::overload_cast<string_view, array_type>(&py_iidb::put), "", "key"_a, "value"_a)
         .def("__setitem__", py::overload_cast<int64_t, array_type>(&py_iidb::put), "", "key"_a, "value"_a)
         .def("getmulti", py::overload_cast<const vector<generic_key_type>&>(&py_iidb::getmulti), "", "keys"_a)
-        .def("putmulti", &py_iidb::putmulti, "", "items"_a);
+        .def("putmulti", &py_iidb::putmulti, "", "items"_a)
+        .def(
+            "getmulti_until",
+            &py_iidb::getmulti_until,
+            "",
+            "keys"_a,
+            "timeout"_a,
+            "missing"_a = static_cast<int>(::iidb::miss_policy::zero))
+        .def(
+            "start_write_queue",
+            &py_iidb::start_write_queue,
+            "",
+            "max_delay_ms"_a = 2.0,
+            "max_batch_items"_a = 1024,
+            "max_batch_bytes"_a = 64 * 1024 * 1024,
+            "nosync"_a = false,
+            "nometasync"_a = false)
+        .def("put_async", &py_iidb::put_async, "", "key"_a, "value"_a)
+        .def("flush", &py_iidb::flush, "")
+        .def("stop_write_queue", &py_iidb::stop_write_queue, "")
+        .def("set_weights", &py_iidb::set_weights, "", "weights"_a)
+        .def("get_weight", &py_iidb::get_weight, "", "key"_a)
+        .def(
+            "sampler",
+            [](py_iidb& db, bool weighted, std::optional<uint64_t> seed) {
+                py::gil_scoped_release release;
+                return py_sampler(db, db.make_sampler(weighted, seed));
+            },
+            "",
+            "weighted"_a = false,
+            "seed"_a = py::none(),
+            py::keep_alive<0, 1>());
+
+    py::class_<py_sampler>(m, "Sampler")
+        .def("__len__", &py_sampler::size, "")
+        .def("sample_keys", &py_sampler::sample_keys, "", "n"_a)
+        .def("sample", &py_sampler::sample, "", "n"_a);
 
     m.def(
         "open",
-        [](string_view path, bool readonly, int mode) { return py_iidb(path, readonly, mode); },
+        [](string_view path, bool readonly, int mode, size_t map_size, double map_growth, size_t map_max_size) {
+            return py_iidb(path, readonly, mode, map_size, map_growth, map_max_size);
+        },
         "",
         "path"_a,
         "readonly"_a = true,
-        "mode"_a = 0);
+        "mode"_a = 0,
+        "map_size"_a = size_t(1) << 30,
+        "map_growth"_a = 2.0,
+        "map_max_size"_a = 0);
+
+    m.attr("ZSTD") = ::iidb::codec::zstd;
+    m.attr("LZ4") = ::iidb::codec::lz4;
+    m.attr("FILTER_SUB") = ::iidb::filters::sub;
+    m.attr("FILTER_PAETH") = ::iidb::filters::paeth;
+    m.attr("FILTER_PLANAR") = ::iidb::filters::planar;
+    m.attr("FILTER_YCOCG") = ::iidb::filters::ycocg;
+    m.attr("MISS_RAISE") = static_cast<int>(::iidb::miss_policy::raise);
+    m.attr("MISS_ZERO") = static_cast<int>(::iidb::miss_policy::zero);
+    m.attr("READ_OK") = static_cast<int>(::iidb::read_status::ok);
+    m.attr("READ_MISSING") = static_cast<int>(::iidb::read_status::missing);
+    m.attr("READ_TIMED_OUT") = static_cast<int>(::iidb::read_status::timed_out);
+    m.attr("READ_FAILED") = static_cast<int>(::iidb::read_status::failed);
 
     m.def("__zstd_version__", []() {
         return std::to_string(ZSTD_VERSION_MAJOR) + '.' + std::to_string(ZSTD_VERSION_MINOR) + '.'
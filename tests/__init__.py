@@ -3,12 +3,14 @@ import random
 import iidb
 import numpy as np
 import os
+import threading
 
 
 class IIDBTestCase(unittest.TestCase):
     def tearDown(self):
-        if os.path.exists('test.mdb'):
-            os.remove('test.mdb')
+        for path in ('test.mdb', 'test.mdb-lock'):
+            if os.path.exists(path):
+                os.remove(path)
 
     @staticmethod
     def _make_array(dims=(5, 5)):
@@ -78,3 +80,161 @@ class IIDBTestCase(unittest.TestCase):
             self.assertFalse(db.closed)
 
         self.assertTrue(db.closed)
+
+    def test_put_async(self):
+        data = [self._make_array() for _ in range(10)]
+        db = iidb.open('test.mdb', readonly=False)
+        db.start_write_queue(max_delay_ms=1.0)
+        futures = [db.put_async(i, array) for i, array in enumerate(data)]
+        db.flush()
+        for future in futures:
+            self.assertTrue(future.done())
+            future.result()
+        db.close()
+
+        db2 = iidb.open('test.mdb', readonly=True)
+        for i, array in enumerate(data):
+            np.testing.assert_array_equal(db2[i], array)
+
+    def test_put_async_rejects_long_keys(self):
+        array = self._make_array()
+        db = iidb.open('test.mdb', readonly=False)
+        db.start_write_queue()
+        future = db.put_async('queued', array)
+        with self.assertRaises(ValueError):
+            db.put_async('k' * 4096, array)
+        db.stop_write_queue()
+        future.result()
+        np.testing.assert_array_equal(db['queued'], array)
+        db.close()
+
+    def test_filters(self):
+        filters = [
+            iidb.FILTER_SUB,
+            iidb.FILTER_PAETH,
+            iidb.FILTER_PLANAR,
+            iidb.FILTER_YCOCG,
+            iidb.FILTER_PLANAR | iidb.FILTER_SUB,
+            iidb.FILTER_YCOCG | iidb.FILTER_PAETH,
+        ]
+        for codec in (iidb.ZSTD, iidb.LZ4):
+            for i, filter in enumerate(filters):
+                for channels in (1, 3, 4):
+                    data = self._make_array((17, 37, channels))
+                    db = iidb.open('test.mdb', readonly=False, mode=codec | filter)
+                    db[i] = data
+                    db.close()
+
+                    db2 = iidb.open('test.mdb', readonly=True)
+                    np.testing.assert_array_equal(db2[i].reshape(data.shape), data)
+                    db2.close()
+
+    def test_sampler(self):
+        data = {i: self._make_array() for i in range(10)}
+        db = iidb.open('test.mdb', readonly=False)
+        db.putmulti(list(data.items()))
+        db.close()
+
+        db2 = iidb.open('test.mdb', readonly=True)
+        sampler = db2.sampler(seed=123)
+        self.assertEqual(len(sampler), 10)
+        keys, images = sampler.sample(20)
+        self.assertEqual(images.shape, (20, 5, 5))
+        for key, image in zip(keys, images):
+            np.testing.assert_array_equal(image, data[int(key)])
+
+        self.assertEqual(db2.sampler(seed=7).sample_keys(5), db2.sampler(seed=7).sample_keys(5))
+
+    def test_weighted_sampler(self):
+        db = iidb.open('test.mdb', readonly=False)
+        db.putmulti([(i, self._make_array()) for i in range(3)])
+        db.set_weights([(0, 1.0), (1, 0.0), (2, 3.0)])
+        self.assertEqual(len(db), 3)
+        self.assertEqual(db.get_weight(2), 3.0)
+        self.assertIsNone(db.get_weight(5))
+        with self.assertRaises(ValueError):
+            db['__iidb_weights__']
+        with self.assertRaises(ValueError):
+            db['__iidb_weights__'] = self._make_array()
+
+        sampler = db.sampler(weighted=True, seed=0)
+        self.assertEqual(len(sampler), 2)
+        self.assertEqual(set(sampler.sample_keys(100)), {'0', '2'})
+
+        # values are read when sampling, so writes made after the sampler show up
+        new = self._make_array()
+        db[2] = new
+        db.set_weights([(0, 0.0)])
+        keys, images = sampler.sample(10)
+        for key, image in zip(keys, images):
+            if key == '2':
+                np.testing.assert_array_equal(image, new)
+
+    def test_map_growth(self):
+        db = iidb.open('test.mdb', readonly=False, map_size=1 << 20)
+        rng = np.random.default_rng(0)
+        data = [rng.integers(0, 255, (256, 256, 3), dtype=np.uint8) for _ in range(16)]
+        db.putmulti(list(enumerate(data)))
+        stats = db.stats()
+        self.assertGreater(stats['map_size'], 1 << 20)
+        self.assertGreaterEqual(stats['free_fraction'], 0.0)
+        self.assertLessEqual(stats['free_fraction'], 1.0)
+        db.close()
+
+        db2 = iidb.open('test.mdb', readonly=True)
+        np.testing.assert_array_equal(db2[15], data[15])
+
+    def test_map_growth_with_readers(self):
+        db = iidb.open('test.mdb', readonly=False, map_size=1 << 20)
+        db[0] = self._make_array()
+        done = threading.Event()
+        errors = []
+
+        def read():
+            try:
+                while not done.is_set():
+                    db[0]
+                    db.getmulti([0, 0])
+            except Exception as e:
+                errors.append(e)
+
+        # reads release the GIL while they hold a snapshot, so the puts below can grow the map around them
+        readers = [threading.Thread(target=read) for _ in range(4)]
+        for reader in readers:
+            reader.start()
+        rng = np.random.default_rng(0)
+        for i in range(1, 17):
+            db[i] = rng.integers(0, 255, (256, 256, 3), dtype=np.uint8)
+        done.set()
+        for reader in readers:
+            reader.join()
+
+        self.assertEqual(errors, [])
+        self.assertGreater(db.stats()['map_size'], 1 << 20)
+        db.close()
+
+    def test_map_max_size(self):
+        db = iidb.open('test.mdb', readonly=False, map_size=1 << 20, map_max_size=1 << 20)
+        data = np.random.default_rng(0).integers(0, 255, (1024, 1024, 3), dtype=np.uint8)
+        with self.assertRaises(RuntimeError):
+            db[1] = data
+
+    def test_getmulti_until(self):
+        data = {i: self._make_array() for i in range(3)}
+        db = iidb.open('test.mdb', readonly=False)
+        db.putmulti(list(data.items()))
+
+        images, status = db.getmulti_until([0, 5, 2], timeout=10.0)
+        self.assertEqual(images.shape, (3, 5, 5))
+        self.assertEqual(list(status), [iidb.READ_OK, iidb.READ_MISSING, iidb.READ_OK])
+        np.testing.assert_array_equal(images[0], data[0])
+        np.testing.assert_array_equal(images[1], np.zeros((5, 5), dtype=np.uint8))
+        np.testing.assert_array_equal(images[2], data[2])
+
+        images, status = db.getmulti_until([0, 1], timeout=-1.0)
+        self.assertEqual(list(status), [iidb.READ_TIMED_OUT] * 2)
+
+        with self.assertRaises(IndexError):
+            db.getmulti_until([0, 5], timeout=10.0, missing=iidb.MISS_RAISE)
+        with self.assertRaises(ValueError):
+            db.getmulti_until([0, 5], timeout=10.0, missing=42)
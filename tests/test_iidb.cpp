@@ -0,0 +1,445 @@
+#include "iidb.hpp"
+#include "iidb.hpp"  // public header, has to survive being included twice
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+#define CHECK(cond)                                                                                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(cond))                                                                                                   \
+            throw std::runtime_error { std::string { __FILE__ ":" } + std::to_string(__LINE__) + ": " #cond };         \
+    } while (0)
+
+static iidb::image make_image(std::uint16_t height, std::uint16_t width, std::uint16_t channels, int seed)
+{
+    iidb::image image { std::vector<std::byte>(height * width * channels), height, width, channels };
+    for (size_t i = 0; i < image.data.size(); i++)
+        image.data[i] = std::byte((i * 7 + seed) % 256);
+    return image;
+}
+
+static void test_api(const std::string& path)
+{
+    auto a = make_image(10, 20, 3, 1);
+    auto b = make_image(10, 20, 3, 2);
+    auto c = make_image(5, 6, 1, 3);
+
+    {
+        iidb::iidb db { path, true };
+        db.put(1, a);
+        db.put("b", b, iidb::codec::lz4 | iidb::filters::sub);
+        db.putmulti({ { 3, c }, { "c", c } });
+    }
+
+    iidb::iidb db { path };
+    CHECK(db.size() == 4);
+    CHECK(db.contains(1));
+    CHECK(db.contains("b"));
+    CHECK(!db.contains(2));
+
+    auto txn = db.begin();
+    auto raw = txn.get("b");
+    CHECK(raw && raw->copy() == std::vector<std::byte>(raw->data(), raw->data() + raw->size()));
+    txn.abort();
+
+    auto image = db.get(1);
+    CHECK(image && image->data == a.data && image->height == 10 && image->width == 20 && image->channels == 3);
+    CHECK(db.get("b")->data == b.data);
+    CHECK(!db.get(2));
+
+    // batched, with mixed keys
+    std::vector<iidb::key_type> keys { 1, "b", 1 };
+    std::vector<std::byte> out(3 * a.data.size());
+    db.getmulti(keys, out.data());
+    CHECK(std::equal(a.data.begin(), a.data.end(), out.begin()));
+    CHECK(std::equal(b.data.begin(), b.data.end(), out.begin() + a.data.size()));
+
+    std::vector<std::byte> strided(2 * 1024);
+    db.getmulti(std::vector<std::string> { "c", "c" }, strided.data(), 1024);
+    CHECK(std::equal(c.data.begin(), c.data.end(), strided.begin() + 1024));
+
+    // a filtered image decodes whole, a stride too short for it must not be written past
+    std::vector<std::byte> narrow(2 * 100);
+    bool threw = false;
+    try
+    {
+        db.getmulti(std::vector<std::string> { "b", "b" }, narrow.data(), narrow.size() / 2);
+    }
+    catch (const std::invalid_argument&)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+
+    threw = false;
+    try
+    {
+        db.getmulti(std::vector<int64_t> { 1, 2 }, out.data());
+    }
+    catch (const std::out_of_range&)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+
+    // async
+    auto future = db.get_async("b");
+    auto missing = db.get_async(2);
+    CHECK(future.get()->data == b.data);
+    CHECK(!missing.get());
+
+    std::fill(out.begin(), out.end(), std::byte(0));
+    db.getmulti_async(keys, out.data()).get();
+    CHECK(std::equal(a.data.begin(), a.data.end(), out.begin() + 2 * a.data.size()));
+    db.getmulti_async(std::vector<int64_t> {}, out.data()).get();
+
+    // the iidb may go away as soon as the future is ready
+    for (int i = 0; i < 20; i++)
+    {
+        iidb::iidb scoped { path };
+        scoped.getmulti_async(keys, out.data()).get();
+    }
+
+    // deadline-bounded, partial results
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    std::fill(out.begin(), out.end(), std::byte(1));
+    auto statuses
+        = db.getmulti_until(std::vector<iidb::key_type> { 1, 2, "b" }, deadline, out.data(), a.data.size());
+    CHECK(statuses[0] == iidb::read_status::ok && statuses[1] == iidb::read_status::missing);
+    CHECK(statuses[2] == iidb::read_status::ok);
+    CHECK(std::equal(b.data.begin(), b.data.end(), out.begin() + 2 * a.data.size()));
+    CHECK(std::all_of(out.begin() + a.data.size(), out.begin() + 2 * a.data.size(), [](auto x) {
+        return x == std::byte(0);
+    }));
+
+    std::fill(out.begin(), out.end(), std::byte(1));
+    statuses = db.getmulti_until(
+        std::vector<int64_t> { 2, 1 }, deadline, out.data(), a.data.size(), iidb::miss_policy::skip);
+    CHECK(statuses[0] == iidb::read_status::missing && out[0] == std::byte(1));
+    CHECK(std::equal(a.data.begin(), a.data.end(), out.begin() + a.data.size()));
+
+    statuses = db.getmulti_until(std::vector<int64_t> { 1, 1 }, std::chrono::steady_clock::now(), out.data());
+    CHECK(statuses[0] == iidb::read_status::timed_out && statuses[1] == iidb::read_status::timed_out);
+
+    threw = false;
+    try
+    {
+        db.getmulti_until(std::vector<int64_t> { 1, 2 }, deadline, out.data(), {}, iidb::miss_policy::raise);
+    }
+    catch (const std::out_of_range&)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+static void test_write_queue(const std::string& path)
+{
+    auto a = make_image(10, 20, 3, 1);
+    iidb::iidb db { path, true };
+    db.start_write_queue({ std::chrono::microseconds(100), 1024, 64 * 1024 * 1024, iidb::openflags::nosync });
+
+    // producers racing the queue being stopped either get their write committed or an error
+    std::atomic<int> committed = 0;
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; t++)
+    {
+        producers.emplace_back([&, t] {
+            for (int i = 0; i < 50; i++)
+            {
+                try
+                {
+                    db.put_async(std::to_string(t * 100 + i), iidb::codec::lz4, 10, 20, 3, a.data.data(), a.data.size())
+                        .get();
+                    committed++;
+                }
+                catch (const std::runtime_error&)
+                { }
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    db.stop_write_queue();
+    for (auto& producer : producers)
+        producer.join();
+
+    CHECK(db.size() == std::size_t(committed));
+    db.put(1000, a);  // synchronous puts are not affected by the queue's durability
+    CHECK(db.get(1000)->data == a.data);
+
+    // a key LMDB can't store is rejected up front instead of failing the batch it would have joined
+    db.start_write_queue();
+    auto queued = db.put_async("queued", iidb::codec::lz4, 10, 20, 3, a.data.data(), a.data.size());
+    bool threw = false;
+    try
+    {
+        db.put_async(std::string(4096, 'k'), iidb::codec::lz4, 10, 20, 3, a.data.data(), a.data.size());
+    }
+    catch (const std::invalid_argument&)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+    db.stop_write_queue();
+    queued.get();
+    CHECK(db.get("queued")->data == a.data);
+}
+
+static void test_sampler(const std::string& path)
+{
+    auto a = make_image(4, 4, 1, 1);
+    auto b = make_image(4, 4, 1, 2);
+    iidb::iidb db { path, true };
+    db.putmulti({ { 1, a }, { 2, a }, { 3, a } });
+    db.set_weights({ { "1", 1.0f }, { "2", 0.0f }, { "3", 2.0f } });
+    CHECK(db.size() == 3);
+
+    // the weights database must not be read or overwritten as an image
+    for (auto access : std::vector<std::function<void()>> {
+             [&] { db.get("__iidb_weights__"); },
+             [&] { db.put("__iidb_weights__", a); },
+             [&] { db.getmulti(std::vector<std::string> { "__iidb_weights__" }, nullptr); },
+         })
+    {
+        bool threw = false;
+        try
+        {
+            access();
+        }
+        catch (const std::invalid_argument&)
+        {
+            threw = true;
+        }
+        CHECK(threw);
+    }
+
+    auto uniform = db.make_sampler(false, 0);
+    auto weighted = db.make_sampler(true, 0);
+    CHECK(uniform.size() == 3 && weighted.size() == 2);
+
+    // samplers scan in chunks, each resuming after the last key of the previous one
+    std::string visited, last;
+    for (std::size_t n = 2; n == 2;)
+    {
+        auto txn = db.begin();
+        n = txn.for_each(*txn.open_dbi(), last, 2, [&](std::string_view key, iidb::blob<std::byte>) {
+            visited += std::string { key } + ",";
+            last = key;
+        });
+    }
+    CHECK(visited == "1,2,3,__iidb_weights__,");
+
+    // samplers hold no snapshot, so writes afterwards are seen by the next sample
+    db.put(3, b);
+    std::vector<std::byte> out(100 * a.data.size());
+    auto keys = db.sample(weighted, 100, out.data());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        CHECK(keys[i] == "1" || keys[i] == "3");
+        const auto& expected = keys[i] == "3" ? b.data : a.data;
+        CHECK(std::equal(expected.begin(), expected.end(), out.begin() + i * a.data.size()));
+    }
+}
+
+static void test_map_growth(const std::string& path)
+{
+    iidb::map_options options;
+    options.initial_size = 1 << 20;
+    options.resize_timeout = std::chrono::milliseconds(5000);
+    iidb::iidb db { path, true, options };
+
+    iidb::image noise { std::vector<std::byte>(128 * 128), 128, 128, 1 };
+    std::mt19937 rng(0);
+    for (auto& x : noise.data)
+        x = std::byte(rng());
+    db.put(0, noise);
+    auto sampler = db.make_sampler();  // neither must a live sampler
+
+    // readers that never pause must not keep the map from growing
+    std::atomic<bool> done = false;
+    std::atomic<int> misses = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++)
+    {
+        readers.emplace_back([&] {
+            while (!done)
+                if (!db.get(0))
+                    misses++;
+        });
+    }
+    auto stop_readers = [&] {
+        done = true;
+        for (auto& reader : readers)
+            reader.join();
+    };
+    try
+    {
+        for (int i = 1; i < 200; i++)
+            db.put(i, noise, iidb::codec::lz4);
+    }
+    catch (...)
+    {
+        stop_readers();
+        throw;
+    }
+    stop_readers();
+
+    CHECK(misses == 0);
+    CHECK(db.stats().map_size > options.initial_size);
+    CHECK(db.get(199)->data == noise.data);
+}
+
+// every simd level has to produce the scalar encoding and undo it
+static void test_snapshot(const std::string& path)
+{
+    auto a = make_image(64, 64, 3, 1);
+    iidb::iidb db { path, true };
+    db.put(1, a);
+
+    // a reader keeps seeing the database as of its begin() while writers commit around it, the pages it reads must
+    // not be handed to those commits
+    auto snapshot = db.begin();
+    auto before = snapshot.get(1)->copy();
+    for (int i = 0; i < 20; i++)
+    {
+        db.put(1, make_image(64, 64, 3, i + 2));
+        db.putmulti({ { 100 + i, a } });
+    }
+    CHECK(snapshot.get(1)->copy() == before);
+    CHECK(!snapshot.get(100));
+    snapshot.abort();
+
+    CHECK(db.get(1)->data == make_image(64, 64, 3, 21).data);
+    CHECK(db.size() == 21);
+}
+
+static void test_corrupt_values(const std::string& path)
+{
+    auto a = make_image(10, 20, 3, 1);
+    iidb::iidb db { path, true };
+    db.put(1, a);
+
+    // values whose payload doesn't decode to the image their header describes
+    db.write([&](iidb::txn& txn) {
+        for (auto mode : { iidb::codec::zstd, iidb::codec::lz4 })
+        {
+            std::vector<std::byte> garbage(64, std::byte(0x5a));
+            std::uint16_t header[4] = { mode, 10, 20, 3 };
+            std::memcpy(garbage.data(), header, sizeof(header));
+            txn.put("garbage" + std::to_string(mode), garbage);
+        }
+
+        auto taller = txn.get(std::to_string(1))->copy();
+        reinterpret_cast<std::uint16_t*>(taller.data())[1] = 11;
+        txn.put("taller", taller);
+    });
+
+    std::vector<std::byte> out(3 * 11 * 20 * 3);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    for (std::string key : { "garbage0", "garbage1", "taller" })
+    {
+        bool threw = false;
+        try
+        {
+            db.getmulti(std::vector<iidb::key_type> { 1, key }, out.data(), out.size() / 3);
+        }
+        catch (const std::runtime_error&)
+        {
+            threw = true;
+        }
+        CHECK(threw);
+
+        std::fill(out.begin(), out.end(), std::byte(1));
+        auto statuses
+            = db.getmulti_until(std::vector<iidb::key_type> { 1, key, 1 }, deadline, out.data(), out.size() / 3);
+        CHECK(statuses[0] == iidb::read_status::ok && statuses[2] == iidb::read_status::ok);
+        CHECK(statuses[1] == iidb::read_status::failed);
+        CHECK(std::all_of(out.begin() + out.size() / 3, out.begin() + 2 * out.size() / 3, [](auto x) {
+            return x == std::byte(0);
+        }));
+    }
+}
+
+static void test_filters(const std::string&)
+{
+    namespace filters = iidb::filters;
+    const std::uint16_t modes[] = {
+        filters::sub,
+        filters::paeth,
+        filters::planar,
+        filters::ycocg,
+        filters::planar | filters::sub,
+        filters::planar | filters::paeth,
+        filters::ycocg | filters::sub,
+        filters::ycocg | filters::paeth,
+    };
+    std::vector<filters::simd_level> levels;
+    for (auto level : { filters::simd_level::scalar, filters::simd_level::sse41, filters::simd_level::avx2 })
+        if (level <= filters::detected_simd_level())
+            levels.push_back(level);
+
+    std::mt19937 rng(0);
+    for (std::size_t width : { 1, 3, 17, 31, 67 })
+    {
+        for (std::size_t channels = 1; channels <= 5; channels++)
+        {
+            const std::size_t height = 5;
+            std::vector<std::uint8_t> src(height * width * channels);
+            for (auto& x : src)
+                x = std::uint8_t(rng());
+
+            for (auto mode : modes)
+            {
+                std::vector<std::uint8_t> expected(src.size());
+                filters::set_simd_level(filters::simd_level::scalar);
+                filters::encode(mode, src.data(), expected.data(), height, width, channels);
+
+                for (auto level : levels)
+                {
+                    filters::set_simd_level(level);
+                    std::vector<std::uint8_t> encoded(src.size()), decoded(src.size());
+                    filters::encode(mode, src.data(), encoded.data(), height, width, channels);
+                    CHECK(encoded == expected);
+                    filters::decode(mode, encoded.data(), decoded.data(), height, width, channels);
+                    CHECK(decoded == src);
+                }
+            }
+        }
+    }
+
+    filters::set_simd_level(filters::detected_simd_level());
+}
+
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : "test_iidb.db";
+
+    std::vector<std::pair<const char*, void (*)(const std::string&)>> tests {
+        { "api", test_api },
+        { "write_queue", test_write_queue },
+        { "sampler", test_sampler },
+        { "map_growth", test_map_growth },
+        { "snapshot", test_snapshot },
+        { "corrupt_values", test_corrupt_values },
+        { "filters", test_filters },
+    };
+    for (auto [name, test] : tests)
+    {
+        auto test_path = path + "." + name;
+        std::remove(test_path.c_str());
+        try
+        {
+            test(test_path);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << name << ": " << e.what() << std::endl;
+            return 1;
+        }
+        std::remove(test_path.c_str());
+    }
+
+    return 0;
+}